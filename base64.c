@@ -23,6 +23,16 @@ Maintainer: Sylvain Miermont
 
 #include "base64.h"
 
+#if defined(B64_NO_SIMD)
+/* table driven loops only, to test and time them */
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define B64_NEON	/* always there when the compiler targets it */
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define B64_SSSE3	/* checked at run time */
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE MACROS ------------------------------------------------------- */
 
@@ -35,63 +45,233 @@ Maintainer: Sylvain Miermont
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE CONSTANTS ---------------------------------------------------- */
 
+/* code -> character for encoding, RFC 1421 alphabet */
+static const char code_table[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* character -> code for decoding, 0xFF for anything out of the alphabet */
+static const uint8_t char_table[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+	0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE MODULE-WIDE VARIABLES ---------------------------------------- */
 
-static char code_62 = '+';	/* RFC 1421 standard character for code 62 */
-static char code_63 = '/';	/* RFC 1421 standard character for code 63 */
 static char code_pad = '=';	/* RFC 1421 padding character if padding */
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE FUNCTIONS DECLARATION ---------------------------------------- */
 
 /**
-@brief Convert a code in the range 0-63 to an ASCII character
+@brief Encode as many full 3 bytes blocks as the vector unit can take
+@return number of blocks encoded, the rest is left to the scalar loop
 */
-char code_to_char(uint8_t x);
+static int encode_blocks(const uint8_t * in, int size, char * out);
 
 /**
-@brief Convert an ASCII character to a code in the range 0-63
+@brief Decode as many full 4 characters blocks as the vector unit can take
+@param out_len usable size of out, the vector unit writes 4 bytes past a block
+@return number of blocks decoded, -1 on an invalid character
 */
-uint8_t char_to_code(char x);
+static int decode_blocks(const char * in, int size, uint8_t * out, int out_len);
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
 
-char code_to_char(uint8_t x) {
-	if (x <= 25) {
-		return 'A' + x;
-	} else if ((x >= 26) && (x <= 51)) {
-		return 'a' + (x-26);
-	} else if ((x >= 52) && (x <= 61)) {
-		return '0' + (x-52);
-	} else if (x == 62) {
-		return code_62;
-	} else if (x == 63) {
-		return code_63;
-	} else {
-		DEBUG("ERROR: %i IS OUT OF RANGE 0-63 FOR BASE64 ENCODING\n", x);
-		exit(EXIT_FAILURE);
-	} //TODO: improve error management
+/* Vector encoders: split 3 bytes into 4 codes, then turn codes into
+characters with an offset picked by range (A-Z, a-z, 0-9, '+', '/') */
+
+#if defined(B64_NEON)
+
+static uint8x16_t code_to_char_neon(uint8x16_t x) {
+	static const uint8_t shift[16] = {
+		(uint8_t)('a' - 26), (uint8_t)('0' - 52), (uint8_t)('0' - 52), (uint8_t)('0' - 52),
+		(uint8_t)('0' - 52), (uint8_t)('0' - 52), (uint8_t)('0' - 52), (uint8_t)('0' - 52),
+		(uint8_t)('0' - 52), (uint8_t)('0' - 52), (uint8_t)('0' - 52), (uint8_t)('+' - 62),
+		(uint8_t)('/' - 63), 'A', 0, 0
+	};
+	uint8x16_t r = vqsubq_u8(x, vdupq_n_u8(51));
+	r = vorrq_u8(r, vandq_u8(vcltq_u8(x, vdupq_n_u8(26)), vdupq_n_u8(13)));
+#if defined(__aarch64__)
+	r = vqtbl1q_u8(vld1q_u8(shift), r);
+#else
+	uint8x8x2_t lut = { { vld1_u8(shift), vld1_u8(shift + 8) } };
+	r = vcombine_u8(vtbl2_u8(lut, vget_low_u8(r)), vtbl2_u8(lut, vget_high_u8(r)));
+#endif
+	return vaddq_u8(r, x);
+}
+
+/* 48 bytes -> 64 characters per round */
+static int encode_blocks(const uint8_t * in, int size, char * out) {
+	const uint8x16_t mask = vdupq_n_u8(0x3F);
+	int i;
+
+	for (i = 0; i + 48 <= size; i += 48) {
+		uint8x16x3_t b = vld3q_u8(in + i);
+		uint8x16x4_t c;
+		c.val[0] = vshrq_n_u8(b.val[0], 2);
+		c.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(b.val[1], 4), vshlq_n_u8(b.val[0], 4)), mask);
+		c.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(b.val[2], 6), vshlq_n_u8(b.val[1], 2)), mask);
+		c.val[3] = vandq_u8(b.val[2], mask);
+		c.val[0] = code_to_char_neon(c.val[0]);
+		c.val[1] = code_to_char_neon(c.val[1]);
+		c.val[2] = code_to_char_neon(c.val[2]);
+		c.val[3] = code_to_char_neon(c.val[3]);
+		vst4q_u8((uint8_t *)out + i / 3 * 4, c);
+	}
+	return i / 3;
 }
 
-uint8_t char_to_code(char x) {
-	if ((x >= 'A') && (x <= 'Z')) {
-		return (uint8_t)x - (uint8_t)'A';
-	} else if ((x >= 'a') && (x <= 'z')) {
-		return (uint8_t)x - (uint8_t)'a' + 26;
-	} else if ((x >= '0') && (x <= '9')) {
-		return (uint8_t)x - (uint8_t)'0' + 52;
-	} else if (x == code_62) {
-		return 62;
-	} else if (x == code_63) {
-		return 63;
-	} else {
-		DEBUG("ERROR: %c (0x%x) IS INVALID CHARACTER FOR BASE64 DECODING\n", x, x);
-		exit(EXIT_FAILURE);
-	} //TODO: improve error management
+/* Vector decoders: characters to codes by range, any character out of
+the alphabet sets a sticky error, then 4 codes are packed into 3 bytes */
+
+static uint8x16_t char_to_code_neon(uint8x16_t x, uint8x16_t * bad) {
+	uint8x16_t up = vsubq_u8(x, vdupq_n_u8('A'));
+	uint8x16_t lo = vsubq_u8(x, vdupq_n_u8('a'));
+	uint8x16_t dg = vsubq_u8(x, vdupq_n_u8('0'));
+	uint8x16_t in_up = vcltq_u8(up, vdupq_n_u8(26));
+	uint8x16_t in_lo = vcltq_u8(lo, vdupq_n_u8(26));
+	uint8x16_t in_dg = vcltq_u8(dg, vdupq_n_u8(10));
+	uint8x16_t plus = vceqq_u8(x, vdupq_n_u8('+'));
+	uint8x16_t slash = vceqq_u8(x, vdupq_n_u8('/'));
+	uint8x16_t c = vandq_u8(up, in_up);
+	c = vorrq_u8(c, vandq_u8(vaddq_u8(lo, vdupq_n_u8(26)), in_lo));
+	c = vorrq_u8(c, vandq_u8(vaddq_u8(dg, vdupq_n_u8(52)), in_dg));
+	c = vorrq_u8(c, vandq_u8(vdupq_n_u8(62), plus));
+	c = vorrq_u8(c, vandq_u8(vdupq_n_u8(63), slash));
+	*bad = vorrq_u8(*bad, vmvnq_u8(vorrq_u8(vorrq_u8(in_up, in_lo), vorrq_u8(in_dg, vorrq_u8(plus, slash)))));
+	return c;
+}
+
+/* 64 characters -> 48 bytes per round */
+static int decode_blocks(const char * in, int size, uint8_t * out, int out_len) {
+	uint8x16_t bad = vdupq_n_u8(0);
+	int i;
+
+	for (i = 0; i + 64 <= size && i / 4 * 3 + 48 <= out_len; i += 64) {
+		uint8x16x4_t c = vld4q_u8((const uint8_t *)in + i);
+		uint8x16x3_t b;
+		c.val[0] = char_to_code_neon(c.val[0], &bad);
+		c.val[1] = char_to_code_neon(c.val[1], &bad);
+		c.val[2] = char_to_code_neon(c.val[2], &bad);
+		c.val[3] = char_to_code_neon(c.val[3], &bad);
+		b.val[0] = vorrq_u8(vshlq_n_u8(c.val[0], 2), vshrq_n_u8(c.val[1], 4));
+		b.val[1] = vorrq_u8(vshlq_n_u8(c.val[1], 4), vshrq_n_u8(c.val[2], 2));
+		b.val[2] = vorrq_u8(vshlq_n_u8(c.val[2], 6), c.val[3]);
+		vst3q_u8(out + i / 4 * 3, b);
+	}
+	uint8x8_t any = vorr_u8(vget_low_u8(bad), vget_high_u8(bad));
+	if (vget_lane_u64(vreinterpret_u64_u8(any), 0) != 0) {
+		return -1;
+	}
+	return i / 4;
+}
+
+#elif defined(B64_SSSE3)
+
+/* 12 bytes -> 16 characters per round, loads 16 bytes so stops 4 early */
+__attribute__((target("ssse3")))
+static int encode_blocks_ssse3(const uint8_t * in, int size, char * out) {
+	const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	int i;
+
+	for (i = 0; i + 16 <= size; i += 12) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + i)), spread);
+		/* codes 0 and 2 with a high mul, 1 and 3 with a low one */
+		__m128i c0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+		__m128i c1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+		__m128i c = _mm_or_si128(c0, c1);
+		__m128i r = _mm_subs_epu8(c, _mm_set1_epi8(51));
+		r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), c), _mm_set1_epi8(13)));
+		r = _mm_add_epi8(_mm_shuffle_epi8(shift, r), c);
+		_mm_storeu_si128((__m128i *)(out + i / 3 * 4), r);
+	}
+	return i / 3;
+}
+
+static int encode_blocks(const uint8_t * in, int size, char * out) {
+	if (__builtin_cpu_supports("ssse3")) {
+		return encode_blocks_ssse3(in, size, out);
+	}
+	return 0;
 }
 
+/* Vector decoders: characters to codes by range, any character out of
+the alphabet sets a sticky error, then 4 codes are packed into 3 bytes */
+
+/* x < n as unsigned bytes */
+__attribute__((target("ssse3")))
+static __m128i below_ssse3(__m128i x, char n) {
+	return _mm_cmpeq_epi8(_mm_subs_epu8(x, _mm_set1_epi8(n - 1)), _mm_setzero_si128());
+}
+
+/* 16 characters -> 12 bytes per round, stores 16 bytes */
+__attribute__((target("ssse3")))
+static int decode_blocks_ssse3(const char * in, int size, uint8_t * out, int out_len) {
+	const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	int i;
+
+	for (i = 0; i + 16 <= size && i / 4 * 3 + 16 <= out_len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i up = _mm_sub_epi8(x, _mm_set1_epi8('A'));
+		__m128i lo = _mm_sub_epi8(x, _mm_set1_epi8('a'));
+		__m128i dg = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+		__m128i in_up = below_ssse3(up, 26);
+		__m128i in_lo = below_ssse3(lo, 26);
+		__m128i in_dg = below_ssse3(dg, 10);
+		__m128i plus = _mm_cmpeq_epi8(x, _mm_set1_epi8('+'));
+		__m128i slash = _mm_cmpeq_epi8(x, _mm_set1_epi8('/'));
+		__m128i c = _mm_and_si128(up, in_up);
+		c = _mm_or_si128(c, _mm_and_si128(_mm_add_epi8(lo, _mm_set1_epi8(26)), in_lo));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_add_epi8(dg, _mm_set1_epi8(52)), in_dg));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_set1_epi8(62), plus));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_set1_epi8(63), slash));
+		__m128i valid = _mm_or_si128(_mm_or_si128(in_up, in_lo), _mm_or_si128(in_dg, _mm_or_si128(plus, slash)));
+		if (_mm_movemask_epi8(valid) != 0xFFFF) {
+			return -1;
+		}
+		/* c0 << 6 | c1 and c2 << 6 | c3 in 16 bits, then the two in 24 bits */
+		c = _mm_madd_epi16(_mm_maddubs_epi16(c, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128((__m128i *)(out + i / 4 * 3), _mm_shuffle_epi8(c, pack));
+	}
+	return i / 4;
+}
+
+static int decode_blocks(const char * in, int size, uint8_t * out, int out_len) {
+	if (__builtin_cpu_supports("ssse3")) {
+		return decode_blocks_ssse3(in, size, out, out_len);
+	}
+	return 0;
+}
+
+#else
+
+static int encode_blocks(const uint8_t * in, int size, char * out) {
+	return 0;
+}
+
+static int decode_blocks(const char * in, int size, uint8_t * out, int out_len) {
+	return 0;
+}
+
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
 
@@ -109,6 +289,10 @@ int bin_to_b64_nopad(const uint8_t * in, int size, char * out, int max_len) {
 		return -1;
 	}
 	if (size == 0) {
+		if (max_len < 1) {
+			DEBUG("ERROR: OUTPUT BUFFER TOO SMALL IN BIN_TO_B64\n");
+			return -1;
+		}
 		*out = 0; /* null string */
 		return 0;
 	}
@@ -137,15 +321,15 @@ int bin_to_b64_nopad(const uint8_t * in, int size, char * out, int max_len) {
 		return -1;
 	}
 	
-	/* process all the full blocks */
-	for (i=0; i < full_blocks; ++i) {
+	/* process all the full blocks, vector unit first */
+	for (i=encode_blocks(in, size, out); i < full_blocks; ++i) {
 		b  = (0xFF & in[3*i]    ) << 16;
 		b |= (0xFF & in[3*i + 1]) << 8;
 		b |=  0xFF & in[3*i + 2];
-		out[4*i + 0] = code_to_char((b >> 18) & 0x3F);
-		out[4*i + 1] = code_to_char((b >> 12) & 0x3F);
-		out[4*i + 2] = code_to_char((b >> 6 ) & 0x3F);
-		out[4*i + 3] = code_to_char( b        & 0x3F);
+		out[4*i + 0] = code_table[(b >> 18) & 0x3F];
+		out[4*i + 1] = code_table[(b >> 12) & 0x3F];
+		out[4*i + 2] = code_table[(b >> 6 ) & 0x3F];
+		out[4*i + 3] = code_table[ b        & 0x3F];
 	}
 	
 	/* process the last 'partial' block and terminate string */
@@ -154,15 +338,15 @@ int bin_to_b64_nopad(const uint8_t * in, int size, char * out, int max_len) {
 		out[4*i] =  0; /* null character to terminate string */
 	} else if (last_chars == 2) {
 		b  = (0xFF & in[3*i]    ) << 16;
-		out[4*i + 0] = code_to_char((b >> 18) & 0x3F);
-		out[4*i + 1] = code_to_char((b >> 12) & 0x3F);
+		out[4*i + 0] = code_table[(b >> 18) & 0x3F];
+		out[4*i + 1] = code_table[(b >> 12) & 0x3F];
 		out[4*i + 2] =  0; /* null character to terminate string */
 	} else if (last_chars == 3) {
 		b  = (0xFF & in[3*i]    ) << 16;
 		b |= (0xFF & in[3*i + 1]) << 8;
-		out[4*i + 0] = code_to_char((b >> 18) & 0x3F);
-		out[4*i + 1] = code_to_char((b >> 12) & 0x3F);
-		out[4*i + 2] = code_to_char((b >> 6 ) & 0x3F);
+		out[4*i + 0] = code_table[(b >> 18) & 0x3F];
+		out[4*i + 1] = code_table[(b >> 12) & 0x3F];
+		out[4*i + 2] = code_table[(b >> 6 ) & 0x3F];
 		out[4*i + 3] = 0; /* null character to terminate string */
 	}
 	
@@ -176,7 +360,8 @@ int b64_to_bin_nopad(const char * in, int size, uint8_t * out, int max_len) {
 	int last_chars; /* number of characters <4 in the last block */
 	int last_bytes; /* number of unsigned chars <3 in the last block */
 	uint32_t b;
-	;
+	uint32_t c0, c1, c2, c3; /* codes of a block */
+	uint8_t bad = 0; /* OR of all codes, bit 7 set by invalid characters */
 	
 	/* check input values */
 	if ((out == NULL) || (in == NULL)) {
@@ -214,12 +399,19 @@ int b64_to_bin_nopad(const char * in, int size, uint8_t * out, int max_len) {
 		return -1;
 	}
 	
-	/* process all the full blocks */
-	for (i=0; i < full_blocks; ++i) {
-		b  = (0x3F & char_to_code(in[4*i]    )) << 18;
-		b |= (0x3F & char_to_code(in[4*i + 1])) << 12;
-		b |= (0x3F & char_to_code(in[4*i + 2])) << 6;
-		b |=  0x3F & char_to_code(in[4*i + 3]);
+	/* process all the full blocks, vector unit first */
+	i = decode_blocks(in, 4*full_blocks, out, max_len);
+	if (i < 0) {
+		DEBUG("ERROR: INVALID CHARACTER IN B64_TO_BIN\n");
+		return -1;
+	}
+	for (; i < full_blocks; ++i) {
+		c0 = char_table[(uint8_t)in[4*i]    ];
+		c1 = char_table[(uint8_t)in[4*i + 1]];
+		c2 = char_table[(uint8_t)in[4*i + 2]];
+		c3 = char_table[(uint8_t)in[4*i + 3]];
+		bad |= c0 | c1 | c2 | c3;
+		b = (c0 << 18) | (c1 << 12) | (c2 << 6) | c3;
 		out[3*i + 0] = (b >> 16) & 0xFF;
 		out[3*i + 1] = (b >> 8 ) & 0xFF;
 		out[3*i + 2] =  b        & 0xFF;
@@ -228,16 +420,20 @@ int b64_to_bin_nopad(const char * in, int size, uint8_t * out, int max_len) {
 	/* process the last 'partial' block */
 	i = full_blocks;
 	if (last_bytes == 1) {
-		b  = (0x3F & char_to_code(in[4*i]    )) << 18;
-		b |= (0x3F & char_to_code(in[4*i + 1])) << 12;
+		c0 = char_table[(uint8_t)in[4*i]    ];
+		c1 = char_table[(uint8_t)in[4*i + 1]];
+		bad |= c0 | c1;
+		b = (c0 << 18) | (c1 << 12);
 		out[3*i + 0] = (b >> 16) & 0xFF;
 		if (((b >> 12) & 0x0F) != 0) {
 			DEBUG("WARNING: last character contains unusable bits\n");
 		}
 	} else if (last_bytes == 2) {
-		b  = (0x3F & char_to_code(in[4*i]    )) << 18;
-		b |= (0x3F & char_to_code(in[4*i + 1])) << 12;
-		b |= (0x3F & char_to_code(in[4*i + 2])) << 6;
+		c0 = char_table[(uint8_t)in[4*i]    ];
+		c1 = char_table[(uint8_t)in[4*i + 1]];
+		c2 = char_table[(uint8_t)in[4*i + 2]];
+		bad |= c0 | c1 | c2;
+		b = (c0 << 18) | (c1 << 12) | (c2 << 6);
 		out[3*i + 0] = (b >> 16) & 0xFF;
 		out[3*i + 1] = (b >> 8 ) & 0xFF;
 		if (((b >> 6) & 0x03) != 0) {
@@ -245,6 +441,12 @@ int b64_to_bin_nopad(const char * in, int size, uint8_t * out, int max_len) {
 		}
 	}
 	
+	/* codes are 0-63, only invalid characters map to 0xFF */
+	if (bad & 0x80) {
+		DEBUG("ERROR: INVALID CHARACTER IN B64_TO_BIN\n");
+		return -1;
+	}
+	
 	return result_len;
 }
 
@@ -40,8 +40,9 @@ int bin_to_b64_nopad(const uint8_t * in, int size, char * out, int max_len);
 @param in string containing only base64 valid characters
 @param size number of characters to be decoded from base64 (w/o null char)
 @param out pointer to a data buffer where the function will output decoded data
-@param out_max_len usable size of the output data buffer
-@return >=0 number of bytes written to the data buffer, -1 for error
+@param out_max_len usable size of the output data buffer, all of it may be written
+@return >=0 number of bytes written to the data buffer, -1 for error (invalid
+character included, the buffer content is then undefined)
 */
 int b64_to_bin_nopad(const char * in, int size, uint8_t * out, int max_len);
 
@@ -54,6 +55,7 @@ int bin_to_b64(const uint8_t * in, int size, char * out, int max_len);
 
 /**
 @brief Decode Base64 string to binary data (remove padding if necessary)
+@return same as b64_to_bin_nopad, padding anywhere but at the end is invalid
 */
 int b64_to_bin(const char * in, int size, uint8_t * out, int max_len);
 
@@ -0,0 +1,56 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "hal.h"
+
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+const Hal_t* hal = &hal_linux;
+
+static const Hal_t* const backends[] = {
+  &hal_linux,
+#ifdef HAL_WIRINGPI
+  &hal_wiringpi,
+#endif
+  &hal_emulator,
+};
+
+const Hal_t* HalFind(const char* name)
+{
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    if (strcmp(backends[i]->name, name) == 0) {
+      return backends[i];
+    }
+  }
+  return NULL;
+}
+
+int HalThreadCreate(pthread_t* thread, void* (*run)(void*), void* arg)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, HAL_THREAD_STACK);
+  int ret = pthread_create(thread, &attr, run, arg);
+  if (ret == EAGAIN) {
+    // RLIMIT_MEMLOCK reached after mlockall(MCL_FUTURE)
+    munlockall();
+    printf("Real-time: locked memory limit reached, memory unlocked\n");
+    fflush(stdout);
+    ret = pthread_create(thread, &attr, run, arg);
+  }
+  pthread_attr_destroy(&attr);
+  return ret;
+}
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Hardware abstraction for the SX127x SPI bus and GPIO lines.
+//
+// All radio access in the forwarder goes through the active backend `hal`.
+// Backends are plain tables of function pointers so a test or simulation
+// backend can be injected by pointing `hal` at another table before the
+// radio is set up.
+
+#ifndef _HAL_H
+#define _HAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define HAL_LOW           0
+#define HAL_HIGH          1
+
+#define HAL_INPUT         0
+#define HAL_OUTPUT        1
+
+#define HAL_PIN_UNUSED    0xff
+
+// Largest single transfer: address byte + full 256 byte FIFO
+#define HAL_SPI_MAX_LEN   257
+// Largest number of transfers queued in one spi_transfer() call
+#define HAL_SPI_MAX_XFERS 8
+// Largest number of radios, i.e. open() calls
+#define HAL_MAX_BUSES     4
+
+// One chip-select framed SPI transfer. tx and rx are both len bytes long,
+// tx may be NULL to clock out zeros and rx may be NULL to discard input.
+typedef struct SpiXfer
+{
+  const uint8_t* tx;
+  uint8_t* rx;
+  uint16_t len;
+} SpiXfer_t;
+
+typedef struct Hal
+{
+  const char* name;
+
+  // Open the SPI bus for one radio and claim its chip select line.
+  // Returns a bus handle for spi_transfer(), or -1. Radios are set up in
+  // parallel: open(), pin_mode() and irq_enable() may run concurrently.
+  int  (*open)(int spi_channel, uint32_t spi_speed, int nss_pin);
+  // Run count transfers back to back, each in its own chip select frame.
+  // Backends may submit them to the kernel as a single request. Safe to
+  // call from one thread per bus. Returns 0 or -1.
+  int  (*spi_transfer)(int bus, const SpiXfer_t* xfers, int count);
+  // Change the SPI clock of an open bus. Returns 0 or -1.
+  int  (*spi_set_speed)(int bus, uint32_t spi_speed);
+
+  // An output starts at value, without a glitch through the other level.
+  // value is ignored for inputs.
+  void (*pin_mode)(int pin, int mode, int value);
+  void (*digital_write)(int pin, int value);
+  int  (*digital_read)(int pin);
+
+  void (*delay_ms)(unsigned int ms);
+
+  // Deliver rising edges on an input pin as events. Returns a file
+  // descriptor that becomes readable (POLLIN) when an edge is pending, or
+  // -1 if the backend cannot do it and the caller has to poll the level.
+  int  (*irq_enable)(int pin);
+  // Consume the pending edge events of pin. Returns how many were read and
+  // stores the CLOCK_MONOTONIC time of the latest edge, in ns, as taken by
+  // the kernel when the interrupt fired.
+  int  (*irq_ack)(int pin, uint64_t* p_timestamp_ns);
+} Hal_t;
+
+// Native Linux backend: /dev/spidevX.Y and /dev/gpiochip0
+extern const Hal_t hal_linux;
+
+#ifdef HAL_WIRINGPI
+// Legacy backend on top of wiringPi / wiringPiSPI
+extern const Hal_t hal_wiringpi;
+#endif
+
+// Software SX127x for runs without hardware, see hal_emulator.cpp
+extern const Hal_t hal_emulator;
+// Load the chips and frames to emulate. Returns false, after printing why,
+// if the script cannot be used.
+bool EmuLoadScript(const char* path);
+
+// Active backend, defaults to hal_linux
+extern const Hal_t* hal;
+
+// Look a backend up by name, NULL if not compiled in
+const Hal_t* HalFind(const char* name);
+
+// Stack of every thread of the forwarder and its backends, instead of the
+// 8 MiB glibc default that mlockall() would have to lock for each of them
+#define HAL_THREAD_STACK  (256 * 1024)
+
+// pthread_create() with a HAL_THREAD_STACK stack. If locked memory cannot
+// take one more stack, memory is unlocked with a warning and the thread
+// created anyway. Returns 0 or an errno value.
+int HalThreadCreate(pthread_t* thread, void* (*run)(void*), void* arg);
+
+#endif
@@ -0,0 +1,879 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Software SX1272 / SX1276 to run the forwarder without a Pi or a radio:
+// "hal": "emulator" and "emulator_script": "<file>" in SX127x_conf.
+//
+// Each emulated chip has a register file, with separate FSK and LoRa sets
+// of 0x0D-0x3F, the 256 byte FIFO, IRQ flags with the DIO0 / DIO3 mapping
+// and the op modes a receiver uses: sleep, standby, RX continuous, RX
+// single and CAD. Scripted frames go on air at their
+// time and are written to the FIFO the way the modem does it, one after
+// the other around the ring, raising ValidHeader and then RxDone. DIO
+// edges come out of eventfds, so the forwarder runs its normal irq path.
+//
+// Script, one directive per line, # starts a comment:
+//
+//   chip nss=<pin> dio0=<pin> [dio3=<pin>] [rst=<pin>] [version=0x12|0x22]
+//   rx at=<ms> nss=<pin> [len=<n>] [data=<hex>] [rssi=<dBm>] [snr=<dB>]
+//      [crc=ok|bad] [sf=<n>] [freq=<Hz>] [count=<n>] [gap=<ms>]
+//   stall at=<ms> nss=<pin> ms=<n>
+//
+// Pins are the ones of global_conf.json. "at" is the RxDone time of the
+// frame in ms after the first open(), which is printed as a tmst value to
+// stderr, count / gap repeat it. Frames have
+// SF7 unless told otherwise and the LoRaWAN public sync word, and land only
+// if their chip listens on that SF and sync word, and on freq when given,
+// from the header on. Without data the payload is
+// the frame number followed by a fixed pattern. A stall holds the first
+// SPI transfer of the chip from "at" on for n ms once it is done, the way a
+// preempted radio thread would. A summary of what landed goes to stderr
+// once the script is done.
+
+#include "hal.h"
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#define EMU_MAX_CHIPS       HAL_MAX_BUSES
+#define EMU_REGS            0x80
+
+// Registers with a behaviour, the rest is plain storage
+#define EMU_REG_FIFO                0x00
+#define EMU_REG_OPMODE              0x01
+#define EMU_REG_FRF_MSB             0x06
+#define EMU_REG_FIFO_ADDR_PTR       0x0D
+#define EMU_REG_PAGE_FIRST          0x0D    // LoRa and FSK sets from here
+#define EMU_REG_PAGE_LAST           0x3F    // to here
+#define EMU_REG_FIFO_RX_BASE_AD     0x0F
+#define EMU_REG_FIFO_RX_CURRENT     0x10
+#define EMU_REG_IRQ_FLAGS_MASK      0x11
+#define EMU_REG_IRQ_FLAGS           0x12
+#define EMU_REG_RX_NB_BYTES         0x13
+#define EMU_REG_MODEM_STAT          0x18
+#define EMU_REG_PKT_SNR             0x19
+#define EMU_REG_PKT_RSSI            0x1A
+#define EMU_REG_RSSI                0x1B
+#define EMU_REG_MODEM_CONFIG        0x1D
+#define EMU_REG_MODEM_CONFIG2       0x1E
+#define EMU_REG_SYMB_TIMEOUT_LSB    0x1F
+#define EMU_REG_FIFO_RX_BYTE_ADDR   0x25
+#define EMU_REG_SYNC_WORD           0x39
+#define EMU_REG_DIO_MAPPING_1       0x40
+#define EMU_REG_VERSION             0x42
+
+#define EMU_IRQ_RX_TIMEOUT          0x80
+#define EMU_IRQ_RX_DONE             0x40
+#define EMU_IRQ_CRC_ERROR           0x20
+#define EMU_IRQ_VALID_HEADER        0x10
+#define EMU_IRQ_CAD_DONE            0x04
+#define EMU_IRQ_CAD_DETECTED        0x01
+
+#define EMU_MODE_LORA               0x80
+#define EMU_MODE_MASK               0x07
+#define EMU_MODE_SLEEP              0x00
+#define EMU_MODE_STANDBY            0x01
+#define EMU_MODE_RX_CONTINUOUS      0x05
+#define EMU_MODE_RX_SINGLE          0x06
+#define EMU_MODE_CAD                0x07
+
+#define EMU_PREAMBLE_SYMBOLS        12  // 8 + sync word, rounded up
+#define EMU_SYNC_WORD_PUBLIC        0x34  // LoRaWAN, what every frame uses
+#define EMU_NO_EVENT                UINT64_MAX
+
+typedef struct EmuFrame
+{
+  int chip;
+  uint64_t pre_ns;      /* preamble starts, from emulator start */
+  uint64_t hdr_ns;      /* ValidHeader */
+  uint64_t end_ns;      /* RxDone */
+  int sf;
+  uint32_t freq;        /* 0 = any */
+  int rssi;
+  int snr;
+  bool crc_ok;
+  uint8_t len;
+  uint8_t data[256];
+} EmuFrame_t;
+
+typedef struct EmuChip
+{
+  // bench wiring, from the script
+  int nss;
+  int dio0;
+  int dio3;
+  int rst;
+  uint8_t version;
+
+  bool opened;
+  uint8_t reg[EMU_REGS];
+  uint8_t fsk[EMU_REGS];        /* FSK set of 0x0D-0x3F, plain storage */
+  uint8_t fifo[256];
+  uint8_t rx_wp;                /* where the modem writes the next byte */
+  uint64_t mode_ns;             /* when the current op mode was entered */
+
+  const EmuFrame_t* rx;         /* frame being received, NULL if none */
+  uint8_t rx_start;
+
+  bool dio0_level;
+  bool dio3_level;
+  int dio0_fd;
+  int dio3_fd;
+  uint64_t dio0_ns;             /* last edges, CLOCK_MONOTONIC */
+  uint64_t dio3_ns;
+
+  uint32_t landed;
+  uint32_t crc_bad;
+  uint32_t missed;              /* not listening, wrong SF / freq, collision */
+  uint32_t aborted;             /* mode changed during reception */
+} EmuChip_t;
+
+typedef struct EmuStall
+{
+  int chip;
+  uint64_t at_ns;       /* from emulator start */
+  uint64_t ns;
+  bool done;
+} EmuStall_t;
+
+static EmuChip_t chips[EMU_MAX_CHIPS];
+static int chip_nb = 0;
+static std::vector<EmuFrame_t> frames;
+static size_t frame_next = 0;
+static std::vector<EmuStall_t> stalls;
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cond;
+static pthread_t emu_thread;
+static bool emu_started = false;
+static bool emu_reported = false;
+static uint64_t emu_start_ns = 0;
+
+static uint64_t EmuClock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Time since the first open(), the script time base
+static uint64_t EmuNow()
+{
+  return EmuClock() - emu_start_ns;
+}
+
+static EmuChip_t* ChipByPin(int pin, int EmuChip_t::* field)
+{
+  for (int i = 0; i < chip_nb; i++) {
+    if (chips[i].*field == pin) {
+      return &chips[i];
+    }
+  }
+  return NULL;
+}
+
+static bool ChipSx1272(const EmuChip_t* c)
+{
+  return c->version == 0x22;
+}
+
+static int ChipSf(const EmuChip_t* c)
+{
+  return c->reg[EMU_REG_MODEM_CONFIG2] >> 4;
+}
+
+static int ChipBwKhz(const EmuChip_t* c)
+{
+  static const int bw[] = { 125, 250, 500 };
+  int idx = ChipSx1272(c) ? c->reg[EMU_REG_MODEM_CONFIG] >> 6 : (c->reg[EMU_REG_MODEM_CONFIG] >> 4) - 7;
+  return (idx >= 0 && idx < 3) ? bw[idx] : 125;
+}
+
+static uint32_t ChipFreq(const EmuChip_t* c)
+{
+  uint32_t frf = (c->reg[EMU_REG_FRF_MSB] << 16) | (c->reg[EMU_REG_FRF_MSB + 1] << 8) | c->reg[EMU_REG_FRF_MSB + 2];
+  return (uint32_t)(((uint64_t)frf * 32000000) >> 19);
+}
+
+static uint64_t ChipSymbolNs(const EmuChip_t* c)
+{
+  return (1000000ULL << ChipSf(c)) / ChipBwKhz(c);
+}
+
+static int ChipMode(const EmuChip_t* c)
+{
+  return c->reg[EMU_REG_OPMODE] & EMU_MODE_MASK;
+}
+
+static bool ChipListens(const EmuChip_t* c, const EmuFrame_t* f)
+{
+  // FRF steps are 61 Hz
+  uint32_t freq = ChipFreq(c);
+  bool freq_ok = f->freq == 0 || (freq > f->freq ? freq - f->freq : f->freq - freq) < 1000;
+  return (c->reg[EMU_REG_OPMODE] & EMU_MODE_LORA) && c->reg[EMU_REG_SYNC_WORD] == EMU_SYNC_WORD_PUBLIC &&
+         freq_ok && ChipSf(c) == f->sf;
+}
+
+// Recompute the DIO lines and signal rising edges
+static void ChipDio(EmuChip_t* c)
+{
+  uint8_t flags = c->reg[EMU_REG_IRQ_FLAGS] & ~c->reg[EMU_REG_IRQ_FLAGS_MASK];
+  uint8_t map = c->reg[EMU_REG_DIO_MAPPING_1];
+  uint8_t dio0_src = ((map >> 6) == 0) ? EMU_IRQ_RX_DONE : ((map >> 6) == 2 ? EMU_IRQ_CAD_DONE : 0);
+  uint8_t dio3_src = ((map & 0x03) == 1) ? EMU_IRQ_VALID_HEADER : 0;
+  bool dio0 = (flags & dio0_src) != 0;
+  bool dio3 = (flags & dio3_src) != 0;
+  uint64_t one = 1;
+
+  if (dio0 && !c->dio0_level) {
+    c->dio0_ns = EmuClock();
+    if (c->dio0_fd >= 0 && write(c->dio0_fd, &one, sizeof(one)) < 0) {
+      perror("emulator: dio0");
+    }
+  }
+  if (dio3 && !c->dio3_level) {
+    c->dio3_ns = EmuClock();
+    if (c->dio3_fd >= 0 && write(c->dio3_fd, &one, sizeof(one)) < 0) {
+      perror("emulator: dio3");
+    }
+  }
+  c->dio0_level = dio0;
+  c->dio3_level = dio3;
+}
+
+static void ChipReset(EmuChip_t* c)
+{
+  memset(c->reg, 0, sizeof(c->reg));
+  memset(c->fsk, 0, sizeof(c->fsk));
+  c->reg[EMU_REG_OPMODE] = 0x09;          // FSK standby
+  c->reg[EMU_REG_FRF_MSB] = 0x6C;         // 434 MHz
+  c->reg[EMU_REG_FRF_MSB + 1] = 0x80;
+  c->reg[0x0E] = 0x80;                    // FIFO TX base
+  c->reg[EMU_REG_MODEM_CONFIG] = ChipSx1272(c) ? 0x08 : 0x72;
+  c->reg[EMU_REG_MODEM_CONFIG2] = 0x70;
+  c->reg[EMU_REG_SYMB_TIMEOUT_LSB] = 0x64;
+  c->reg[0x22] = 0x01;                    // payload length
+  c->reg[0x23] = 0xFF;                    // max payload length
+  c->reg[EMU_REG_SYNC_WORD] = 0x12;       // private networks
+  c->reg[EMU_REG_VERSION] = c->version;
+  c->rx = NULL;
+  c->rx_wp = 0;
+  c->mode_ns = EmuNow();
+  ChipDio(c);
+}
+
+static void ChipSetMode(EmuChip_t* c, uint8_t value)
+{
+  int old = ChipMode(c);
+  int mode = value & EMU_MODE_MASK;
+
+  // LongRangeMode can only change in sleep
+  if (old != EMU_MODE_SLEEP) {
+    value = (value & ~EMU_MODE_LORA) | (c->reg[EMU_REG_OPMODE] & EMU_MODE_LORA);
+  }
+  c->reg[EMU_REG_OPMODE] = value;
+
+  if (mode != old) {
+    c->mode_ns = EmuNow();
+    if (c->rx != NULL) {
+      c->rx = NULL;
+      c->aborted++;
+    }
+    if (mode == EMU_MODE_RX_CONTINUOUS || mode == EMU_MODE_RX_SINGLE) {
+      c->rx_wp = c->reg[EMU_REG_FIFO_RX_BASE_AD];
+    }
+    pthread_cond_signal(&emu_cond);
+  }
+}
+
+// Bytes of the frame in flight already written to the FIFO
+static int ChipRxWritten(const EmuChip_t* c, uint64_t now)
+{
+  if (now >= c->rx->end_ns) {
+    return c->rx->len;
+  }
+  return (int)((now - c->rx->hdr_ns) * c->rx->len / (c->rx->end_ns - c->rx->hdr_ns));
+}
+
+// Whether addr is one of the FSK registers, which the LoRa ones replace
+// once LongRangeMode is set
+static bool ChipFskPage(const EmuChip_t* c, uint8_t addr)
+{
+  return addr >= EMU_REG_PAGE_FIRST && addr <= EMU_REG_PAGE_LAST && !(c->reg[EMU_REG_OPMODE] & EMU_MODE_LORA);
+}
+
+static uint8_t ChipRead(EmuChip_t* c, uint8_t addr)
+{
+  if (ChipFskPage(c, addr)) {
+    return c->fsk[addr];
+  }
+  switch (addr) {
+    case EMU_REG_FIFO:
+      return c->fifo[c->reg[EMU_REG_FIFO_ADDR_PTR]++];
+    case EMU_REG_MODEM_STAT:
+      // signal detected, synchronized, header valid / modem clear
+      return c->rx != NULL ? 0x0B : 0x10;
+    case EMU_REG_FIFO_RX_BYTE_ADDR:
+      if (c->rx != NULL) {
+        return (uint8_t)(c->rx_start + ChipRxWritten(c, EmuNow()) - 1);
+      }
+      return c->reg[addr];
+    default:
+      return c->reg[addr];
+  }
+}
+
+static void ChipWrite(EmuChip_t* c, uint8_t addr, uint8_t value)
+{
+  if (ChipFskPage(c, addr)) {
+    c->fsk[addr] = value;
+    return;
+  }
+  switch (addr) {
+    case EMU_REG_FIFO:
+      c->fifo[c->reg[EMU_REG_FIFO_ADDR_PTR]++] = value;
+      break;
+    case EMU_REG_OPMODE:
+      ChipSetMode(c, value);
+      break;
+    case EMU_REG_IRQ_FLAGS:
+      c->reg[addr] &= ~value;
+      ChipDio(c);
+      break;
+    case EMU_REG_FIFO_RX_CURRENT:
+    case EMU_REG_RX_NB_BYTES:
+    case EMU_REG_MODEM_STAT:
+    case EMU_REG_PKT_SNR:
+    case EMU_REG_PKT_RSSI:
+    case EMU_REG_RSSI:
+    case EMU_REG_FIFO_RX_BYTE_ADDR:
+    case EMU_REG_VERSION:
+      break;
+    default:
+      c->reg[addr] = value;
+      if (addr == EMU_REG_DIO_MAPPING_1 || addr == EMU_REG_IRQ_FLAGS_MASK) {
+        ChipDio(c);
+      }
+      break;
+  }
+}
+
+// The header of f is in: lock on it if the chip listens
+static void FrameHeader(EmuChip_t* c, const EmuFrame_t* f)
+{
+  int mode = ChipMode(c);
+  if ((mode != EMU_MODE_RX_CONTINUOUS && mode != EMU_MODE_RX_SINGLE) || c->rx != NULL || !ChipListens(c, f)) {
+    c->missed++;
+    return;
+  }
+
+  c->rx = f;
+  c->rx_start = c->rx_wp;
+  for (int i = 0; i < f->len; i++) {
+    c->fifo[c->rx_wp++] = f->data[i];
+  }
+  c->reg[EMU_REG_IRQ_FLAGS] |= EMU_IRQ_VALID_HEADER;
+  ChipDio(c);
+}
+
+static void FrameDone(EmuChip_t* c)
+{
+  const EmuFrame_t* f = c->rx;
+  int rssicorr = ChipSx1272(c) ? 139 : 157;
+
+  c->reg[EMU_REG_FIFO_RX_CURRENT] = c->rx_start;
+  c->reg[EMU_REG_RX_NB_BYTES] = f->len;
+  c->reg[EMU_REG_FIFO_RX_BYTE_ADDR] = (uint8_t)(c->rx_start + f->len - 1);
+  c->reg[EMU_REG_PKT_SNR] = (uint8_t)(int8_t)(f->snr * 4);
+  c->reg[EMU_REG_PKT_RSSI] = (uint8_t)(f->rssi + rssicorr);
+  c->reg[EMU_REG_RSSI] = (uint8_t)(f->rssi + rssicorr);
+  c->reg[EMU_REG_IRQ_FLAGS] |= EMU_IRQ_RX_DONE | (f->crc_ok ? 0 : EMU_IRQ_CRC_ERROR);
+  c->rx = NULL;
+  if (f->crc_ok) {
+    c->landed++;
+  } else {
+    c->crc_bad++;
+  }
+  if (ChipMode(c) == EMU_MODE_RX_SINGLE) {
+    c->reg[EMU_REG_OPMODE] = (c->reg[EMU_REG_OPMODE] & ~EMU_MODE_MASK) | EMU_MODE_STANDBY;
+  }
+  ChipDio(c);
+}
+
+// End of a CAD: a preamble of a frame on this SF is on air right now
+static void CadDone(EmuChip_t* c, uint64_t now)
+{
+  bool detected = false;
+  for (size_t i = frame_next; i < frames.size() && frames[i].pre_ns <= now; i++) {
+    const EmuFrame_t* f = &frames[i];
+    if (&chips[f->chip] == c && now <= f->hdr_ns && ChipListens(c, f)) {
+      detected = true;
+    }
+  }
+  c->reg[EMU_REG_IRQ_FLAGS] |= EMU_IRQ_CAD_DONE | (detected ? EMU_IRQ_CAD_DETECTED : 0);
+  c->reg[EMU_REG_OPMODE] = (c->reg[EMU_REG_OPMODE] & ~EMU_MODE_MASK) | EMU_MODE_STANDBY;
+  c->mode_ns = now;
+  ChipDio(c);
+}
+
+// A frame c listens to whose preamble is on air at some point between the
+// start of the current mode and until, i.e. one an RX single window locks on
+static bool ChipPreamble(const EmuChip_t* c, uint64_t until)
+{
+  // frames are in header order and no preamble lasts a second
+  for (size_t i = frame_next; i < frames.size() && frames[i].hdr_ns <= until + 1000000000ULL; i++) {
+    const EmuFrame_t* f = &frames[i];
+    if (&chips[f->chip] == c && f->pre_ns <= until && f->hdr_ns > c->mode_ns && ChipListens(c, f)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Next chip event: end of the frame in flight, of a CAD or of an RX single
+// window. The window does not time out on a preamble it has locked on, the
+// header of that frame comes next.
+static uint64_t ChipNextEvent(const EmuChip_t* c)
+{
+  int mode = ChipMode(c);
+  if (c->rx != NULL) {
+    return c->rx->end_ns;
+  }
+  if (mode == EMU_MODE_CAD) {
+    return c->mode_ns + 2 * ChipSymbolNs(c);
+  }
+  if (mode == EMU_MODE_RX_SINGLE) {
+    int symbols = ((c->reg[EMU_REG_MODEM_CONFIG2] & 0x03) << 8) | c->reg[EMU_REG_SYMB_TIMEOUT_LSB];
+    uint64_t timeout = c->mode_ns + symbols * ChipSymbolNs(c);
+    return ChipPreamble(c, timeout) ? EMU_NO_EVENT : timeout;
+  }
+  return EMU_NO_EVENT;
+}
+
+// Run everything due at now, returns the time of the next event
+static uint64_t EmuStep(uint64_t now)
+{
+  uint64_t next = EMU_NO_EVENT;
+
+  while (frame_next < frames.size() && frames[frame_next].hdr_ns <= now) {
+    const EmuFrame_t* f = &frames[frame_next++];
+    FrameHeader(&chips[f->chip], f);
+  }
+
+  for (int i = 0; i < chip_nb; i++) {
+    EmuChip_t* c = &chips[i];
+    uint64_t due = ChipNextEvent(c);
+    if (due <= now) {
+      if (c->rx != NULL) {
+        FrameDone(c);
+      } else if (ChipMode(c) == EMU_MODE_CAD) {
+        CadDone(c, now);
+      } else {
+        c->reg[EMU_REG_IRQ_FLAGS] |= EMU_IRQ_RX_TIMEOUT;
+        c->reg[EMU_REG_OPMODE] = (c->reg[EMU_REG_OPMODE] & ~EMU_MODE_MASK) | EMU_MODE_STANDBY;
+        ChipDio(c);
+      }
+      due = ChipNextEvent(c);
+    }
+    next = std::min(next, due);
+  }
+
+  if (frame_next < frames.size()) {
+    next = std::min(next, frames[frame_next].hdr_ns);
+  } else if (next == EMU_NO_EVENT && !emu_reported) {
+    emu_reported = true;
+    for (int i = 0; i < chip_nb; i++) {
+      const EmuChip_t* c = &chips[i];
+      fprintf(stderr, "emulator: chip nss=%d: %u landed, %u CRC errors, %u missed, %u aborted\n",
+              c->nss, c->landed, c->crc_bad, c->missed, c->aborted);
+    }
+  }
+  return next;
+}
+
+static void* EmuThread(void* arg)
+{
+  pthread_mutex_lock(&emu_lock);
+  while (1) {
+    uint64_t next = EmuStep(EmuNow());
+    if (next == EMU_NO_EVENT) {
+      pthread_cond_wait(&emu_cond, &emu_lock);
+      continue;
+    }
+    uint64_t at = emu_start_ns + next;
+    struct timespec ts;
+    ts.tv_sec = at / 1000000000ULL;
+    ts.tv_nsec = at % 1000000000ULL;
+    pthread_cond_timedwait(&emu_cond, &emu_lock, &ts);
+  }
+  return NULL;
+}
+
+// "key=value" of a script line, NULL if not there
+static const char* ScriptValue(char** tokens, int count, const char* key)
+{
+  size_t len = strlen(key);
+  for (int i = 1; i < count; i++) {
+    if (strncmp(tokens[i], key, len) == 0 && tokens[i][len] == '=') {
+      return tokens[i] + len + 1;
+    }
+  }
+  return NULL;
+}
+
+static long ScriptInt(char** tokens, int count, const char* key, long def)
+{
+  const char* value = ScriptValue(tokens, count, key);
+  return value != NULL ? strtol(value, NULL, 0) : def;
+}
+
+// Time on air of the payload part and of the whole frame, BW 125 kHz,
+// CR 4/5, explicit header with CRC
+static void FrameTiming(EmuFrame_t* f, uint64_t end_ns)
+{
+  uint64_t tsym = (1000000ULL << f->sf) / 125;
+  int bits = 8 * f->len - 4 * f->sf + 28 + 16;
+  int payload = 8 + (bits > 0 ? (bits + 4 * f->sf - 1) / (4 * f->sf) * 5 : 0);
+
+  f->end_ns = end_ns;
+  f->hdr_ns = end_ns - std::min(end_ns, payload * tsym);
+  f->pre_ns = f->hdr_ns - std::min(f->hdr_ns, EMU_PREAMBLE_SYMBOLS * tsym);
+}
+
+static bool ScriptRx(char** tokens, int count, int line)
+{
+  EmuFrame_t f;
+  memset(&f, 0, sizeof(f));
+
+  EmuChip_t* c = ChipByPin(ScriptInt(tokens, count, "nss", -1), &EmuChip_t::nss);
+  if (c == NULL) {
+    fprintf(stderr, "emulator: line %d: no chip on that nss\n", line);
+    return false;
+  }
+  f.chip = c - chips;
+  f.sf = ScriptInt(tokens, count, "sf", 7);
+  f.freq = ScriptInt(tokens, count, "freq", 0);
+  f.rssi = ScriptInt(tokens, count, "rssi", -60);
+  f.snr = ScriptInt(tokens, count, "snr", 9);
+  const char* crc = ScriptValue(tokens, count, "crc");
+  f.crc_ok = crc == NULL || strcmp(crc, "bad") != 0;
+
+  const char* data = ScriptValue(tokens, count, "data");
+  int len = ScriptInt(tokens, count, "len", 16);
+  if (data != NULL) {
+    len = strlen(data) / 2;
+    for (int i = 0; i < len && i < 255; i++) {
+      unsigned int byte;
+      sscanf(data + 2 * i, "%2x", &byte);
+      f.data[i] = byte;
+    }
+  }
+  if (len < 1 || len > 255) {
+    fprintf(stderr, "emulator: line %d: bad frame length\n", line);
+    return false;
+  }
+  f.len = len;
+
+  long at = ScriptInt(tokens, count, "at", 0);
+  long gap = ScriptInt(tokens, count, "gap", 1000);
+  long repeat = ScriptInt(tokens, count, "count", 1);
+  for (long i = 0; i < repeat; i++) {
+    if (data == NULL) {
+      uint32_t seq = frames.size();
+      for (int b = 0; b < len; b++) {
+        f.data[b] = b < 4 ? (uint8_t)(seq >> (8 * (3 - b))) : (uint8_t)(b * 0x1D);
+      }
+    }
+    FrameTiming(&f, (uint64_t)(at + i * gap) * 1000000ULL);
+    frames.push_back(f);
+  }
+  return true;
+}
+
+static bool ScriptStall(char** tokens, int count, int line)
+{
+  EmuStall_t st;
+
+  EmuChip_t* c = ChipByPin(ScriptInt(tokens, count, "nss", -1), &EmuChip_t::nss);
+  if (c == NULL) {
+    fprintf(stderr, "emulator: line %d: no chip on that nss\n", line);
+    return false;
+  }
+  st.chip = c - chips;
+  st.at_ns = (uint64_t)ScriptInt(tokens, count, "at", 0) * 1000000ULL;
+  st.ns = (uint64_t)ScriptInt(tokens, count, "ms", 0) * 1000000ULL;
+  st.done = false;
+  stalls.push_back(st);
+  return true;
+}
+
+static bool FramePreambleFirst(const EmuFrame_t& a, const EmuFrame_t& b)
+{
+  return a.hdr_ns < b.hdr_ns;
+}
+
+bool EmuLoadScript(const char* path)
+{
+  FILE* p_file = fopen(path, "r");
+  char buf[1024];
+  int line = 0;
+
+  if (p_file == NULL) {
+    perror(path);
+    return false;
+  }
+
+  while (fgets(buf, sizeof(buf), p_file) != NULL) {
+    char* tokens[32];
+    int count = 0;
+
+    line++;
+    char* comment = strchr(buf, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    for (char* tok = strtok(buf, " \t\r\n"); tok != NULL && count < 32; tok = strtok(NULL, " \t\r\n")) {
+      tokens[count++] = tok;
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    if (strcmp(tokens[0], "chip") == 0) {
+      if (chip_nb == EMU_MAX_CHIPS) {
+        fprintf(stderr, "emulator: line %d: too many chips\n", line);
+        fclose(p_file);
+        return false;
+      }
+      EmuChip_t* c = &chips[chip_nb++];
+      memset(c, 0, sizeof(*c));
+      c->nss = ScriptInt(tokens, count, "nss", HAL_PIN_UNUSED);
+      c->dio0 = ScriptInt(tokens, count, "dio0", HAL_PIN_UNUSED);
+      c->dio3 = ScriptInt(tokens, count, "dio3", HAL_PIN_UNUSED);
+      c->rst = ScriptInt(tokens, count, "rst", HAL_PIN_UNUSED);
+      c->version = ScriptInt(tokens, count, "version", 0x12);
+      c->dio0_fd = -1;
+      c->dio3_fd = -1;
+      ChipReset(c);
+    } else if (strcmp(tokens[0], "rx") == 0) {
+      if (!ScriptRx(tokens, count, line)) {
+        fclose(p_file);
+        return false;
+      }
+    } else if (strcmp(tokens[0], "stall") == 0) {
+      if (!ScriptStall(tokens, count, line)) {
+        fclose(p_file);
+        return false;
+      }
+    } else {
+      fprintf(stderr, "emulator: line %d: unknown directive %s\n", line, tokens[0]);
+      fclose(p_file);
+      return false;
+    }
+  }
+  fclose(p_file);
+
+  std::stable_sort(frames.begin(), frames.end(), FramePreambleFirst);
+  return true;
+}
+
+static int EmuOpen(int spi_channel, uint32_t spi_speed, int nss_pin)
+{
+  pthread_mutex_lock(&emu_lock);
+  EmuChip_t* c = ChipByPin(nss_pin, &EmuChip_t::nss);
+  if (c == NULL || c->opened) {
+    pthread_mutex_unlock(&emu_lock);
+    fprintf(stderr, "emulator: no chip on nss %d in the script\n", nss_pin);
+    return -1;
+  }
+  c->opened = true;
+
+  if (!emu_started) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&emu_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    emu_start_ns = EmuClock();
+    emu_started = HalThreadCreate(&emu_thread, EmuThread, NULL) == 0;
+    // rxpk tmst is the CLOCK_MONOTONIC us of RxDone, so that runs can
+    // compare it with the script times
+    fprintf(stderr, "emulator: script time 0 is tmst %u\n", (uint32_t)(emu_start_ns / 1000));
+  }
+  pthread_mutex_unlock(&emu_lock);
+  return emu_started ? (int)(c - chips) : -1;
+}
+
+static int EmuSpiTransfer(int bus, const SpiXfer_t* xfers, int count)
+{
+  if (bus < 0 || bus >= chip_nb) {
+    return -1;
+  }
+  EmuChip_t* c = &chips[bus];
+
+  pthread_mutex_lock(&emu_lock);
+  for (int i = 0; i < count; i++) {
+    const SpiXfer_t* x = &xfers[i];
+    uint8_t addr = x->tx != NULL ? x->tx[0] & 0x7F : 0;
+    bool write = x->tx != NULL && (x->tx[0] & 0x80);
+
+    if (x->rx != NULL && x->len > 0) {
+      x->rx[0] = 0x00;
+    }
+    for (int b = 1; b < x->len; b++) {
+      if (write) {
+        ChipWrite(c, addr, x->tx[b]);
+      } else {
+        uint8_t value = ChipRead(c, addr);
+        if (x->rx != NULL) {
+          x->rx[b] = value;
+        }
+      }
+      // bursts auto-increment, except on the FIFO
+      if (addr != EMU_REG_FIFO) {
+        addr = (addr + 1) & (EMU_REGS - 1);
+      }
+    }
+  }
+
+  uint64_t stall_ns = 0;
+  uint64_t now = EmuNow();
+  for (size_t i = 0; i < stalls.size(); i++) {
+    EmuStall_t* st = &stalls[i];
+    if (st->chip == bus && !st->done && st->at_ns <= now) {
+      st->done = true;
+      stall_ns = st->ns;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&emu_lock);
+
+  // the chip goes on without us meanwhile
+  if (stall_ns > 0) {
+    struct timespec ts;
+    ts.tv_sec = stall_ns / 1000000000ULL;
+    ts.tv_nsec = stall_ns % 1000000000ULL;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+  }
+  return 0;
+}
+
+static int EmuSpiSetSpeed(int bus, uint32_t spi_speed)
+{
+  return (bus >= 0 && bus < chip_nb) ? 0 : -1;
+}
+
+static void EmuPinMode(int pin, int mode, int value)
+{
+}
+
+static void EmuDigitalWrite(int pin, int value)
+{
+  pthread_mutex_lock(&emu_lock);
+  EmuChip_t* c = ChipByPin(pin, &EmuChip_t::rst);
+  // SX1272 reset is active high, SX1276 active low
+  if (c != NULL && value == (ChipSx1272(c) ? HAL_HIGH : HAL_LOW)) {
+    ChipReset(c);
+  }
+  pthread_mutex_unlock(&emu_lock);
+}
+
+static int EmuDigitalRead(int pin)
+{
+  int level = HAL_LOW;
+
+  pthread_mutex_lock(&emu_lock);
+  EmuChip_t* c = ChipByPin(pin, &EmuChip_t::dio0);
+  if (c != NULL) {
+    level = c->dio0_level ? HAL_HIGH : HAL_LOW;
+  } else if ((c = ChipByPin(pin, &EmuChip_t::dio3)) != NULL) {
+    level = c->dio3_level ? HAL_HIGH : HAL_LOW;
+  }
+  pthread_mutex_unlock(&emu_lock);
+  return level;
+}
+
+static void EmuDelayMs(unsigned int ms)
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+  }
+}
+
+static int EmuIrqEnable(int pin)
+{
+  int fd = -1;
+
+  pthread_mutex_lock(&emu_lock);
+  EmuChip_t* c = ChipByPin(pin, &EmuChip_t::dio0);
+  if (c != NULL) {
+    if (c->dio0_fd < 0) {
+      c->dio0_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    fd = c->dio0_fd;
+  } else if ((c = ChipByPin(pin, &EmuChip_t::dio3)) != NULL) {
+    if (c->dio3_fd < 0) {
+      c->dio3_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    fd = c->dio3_fd;
+  }
+  pthread_mutex_unlock(&emu_lock);
+  return fd;
+}
+
+static int EmuIrqAck(int pin, uint64_t* p_timestamp_ns)
+{
+  uint64_t count = 0;
+  int fd = -1;
+  uint64_t ns = 0;
+
+  pthread_mutex_lock(&emu_lock);
+  EmuChip_t* c = ChipByPin(pin, &EmuChip_t::dio0);
+  if (c != NULL) {
+    fd = c->dio0_fd;
+    ns = c->dio0_ns;
+  } else if ((c = ChipByPin(pin, &EmuChip_t::dio3)) != NULL) {
+    fd = c->dio3_fd;
+    ns = c->dio3_ns;
+  }
+  pthread_mutex_unlock(&emu_lock);
+
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+    return -1;
+  }
+  *p_timestamp_ns = ns;
+  return (int)count;
+}
+
+const Hal_t hal_emulator = {
+  "emulator",
+  EmuOpen,
+  EmuSpiTransfer,
+  EmuSpiSetSpeed,
+  EmuPinMode,
+  EmuDigitalWrite,
+  EmuDigitalRead,
+  EmuDelayMs,
+  EmuIrqEnable,
+  EmuIrqAck,
+};
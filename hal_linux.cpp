@@ -0,0 +1,331 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Native Linux backend: SPI through spidev, GPIO through the GPIO character
+// device (uAPI v2).
+//
+// Pin numbers in global_conf.json are Wiring Pi numbers, they are translated
+// to BCM line offsets on gpiochip0 here so the configuration stays the same
+// whichever backend is used.
+//
+// When the NSS pin is one of the SPI0 chip enables (CE0 = BCM8, CE1 = BCM7)
+// the matching /dev/spidev0.N is used with hardware chip select and a whole
+// batch of transfers goes to the kernel as one SPI_IOC_MESSAGE(n) ioctl.
+// Any other NSS pin is driven as a GPIO around each transfer, under a lock
+// so that two radios sharing a spidev device never overlap.
+//
+// Interrupt pins are requested with rising edge detection, the line request
+// fd is then handed out for poll() and edge events are read from it.
+
+#include "hal.h"
+
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#define GPIO_CHIP       "/dev/gpiochip0"
+#define GPIO_CONSUMER   "single_chan_pkt_fwd"
+#define GPIO_MAX_LINES  64
+
+#define BCM_SPI0_CE0    8
+#define BCM_SPI0_CE1    7
+
+typedef struct SpiBus
+{
+  int fd;
+  uint32_t speed_hz;
+  int cs_line;        // BCM offset of a GPIO driven NSS, -1 = hardware CS
+} SpiBus_t;
+
+static SpiBus_t buses[HAL_MAX_BUSES];
+static int bus_nb = 0;
+static pthread_mutex_t cs_lock = PTHREAD_MUTEX_INITIALIZER;
+// radios are set up in parallel, guards bus_nb and the line table
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int chip_fd = -1;
+static int line_fd[GPIO_MAX_LINES];
+static bool line_init = false;
+
+// Wiring Pi pin -> BCM GPIO, Raspberry Pi rev 2 and later
+static const int wpi_to_bcm[] = {
+  17, 18, 27, 22, 23, 24, 25,  4,  2,  3,  8,  7, 10,  9, 11, 14,
+  15, 28, 29, 30, 31,  5,  6, 13, 19, 26, 12, 16, 20, 21,  0,  1
+};
+
+static int WpiToBcm(int pin)
+{
+  if (pin < 0 || pin >= (int)(sizeof(wpi_to_bcm) / sizeof(wpi_to_bcm[0]))) {
+    return -1;
+  }
+  return wpi_to_bcm[pin];
+}
+
+static int OpenChip()
+{
+  if (!line_init) {
+    for (int i = 0; i < GPIO_MAX_LINES; i++) {
+      line_fd[i] = -1;
+    }
+    line_init = true;
+  }
+  if (chip_fd < 0) {
+    chip_fd = open(GPIO_CHIP, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0) {
+      perror(GPIO_CHIP);
+    }
+  }
+  return chip_fd;
+}
+
+// An output line is driven at value as soon as it is requested
+static int RequestLineLocked(int bcm, uint64_t flags, int value)
+{
+  if (OpenChip() < 0) {
+    return -1;
+  }
+  if (line_fd[bcm] >= 0) {
+    close(line_fd[bcm]);
+    line_fd[bcm] = -1;
+  }
+
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = bcm;
+  req.num_lines = 1;
+  req.config.flags = flags;
+  if (flags & GPIO_V2_LINE_FLAG_OUTPUT) {
+    // otherwise the kernel drives it low until the first SetLine()
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = value ? 1 : 0;
+    req.config.attrs[0].mask = 1;
+    req.config.num_attrs = 1;
+  }
+  strncpy(req.consumer, GPIO_CONSUMER, sizeof(req.consumer) - 1);
+
+  if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+    fprintf(stderr, "gpio: cannot request line %d: %s\n", bcm, strerror(errno));
+    return -1;
+  }
+  line_fd[bcm] = req.fd;
+  return req.fd;
+}
+
+static int RequestLine(int bcm, uint64_t flags, int value)
+{
+  pthread_mutex_lock(&setup_lock);
+  int fd = RequestLineLocked(bcm, flags, value);
+  pthread_mutex_unlock(&setup_lock);
+  return fd;
+}
+
+static void SetLine(int bcm, int value)
+{
+  struct gpio_v2_line_values values;
+  values.mask = 1;
+  values.bits = value ? 1 : 0;
+  ioctl(line_fd[bcm], GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+static int LinuxOpen(int spi_channel, uint32_t spi_speed, int nss_pin)
+{
+  int nss = WpiToBcm(nss_pin);
+  char dev[32];
+
+  pthread_mutex_lock(&setup_lock);
+  int bus_id = bus_nb < HAL_MAX_BUSES ? bus_nb++ : -1;
+  pthread_mutex_unlock(&setup_lock);
+  if (bus_id < 0) {
+    fprintf(stderr, "spi: too many radios\n");
+    return -1;
+  }
+  SpiBus_t* bus = &buses[bus_id];
+  bus->fd = -1;
+
+  if (nss == BCM_SPI0_CE0 || nss == BCM_SPI0_CE1) {
+    snprintf(dev, sizeof(dev), "/dev/spidev0.%d", nss == BCM_SPI0_CE0 ? 0 : 1);
+    bus->cs_line = -1;
+  } else {
+    snprintf(dev, sizeof(dev), "/dev/spidev0.%d", spi_channel);
+    // deselected from the start
+    if (nss < 0 || RequestLine(nss, GPIO_V2_LINE_FLAG_OUTPUT, HAL_HIGH) < 0) {
+      return -1;
+    }
+    bus->cs_line = nss;
+  }
+
+  bus->fd = open(dev, O_RDWR | O_CLOEXEC);
+  if (bus->fd < 0) {
+    perror(dev);
+    return -1;
+  }
+
+  uint32_t mode = SPI_MODE_0;
+  uint8_t bits = 8;
+  if (bus->cs_line >= 0) {
+    // not every controller supports it, the CE pin then just toggles unused
+    uint32_t no_cs = mode | SPI_NO_CS;
+    if (ioctl(bus->fd, SPI_IOC_WR_MODE32, &no_cs) == 0) {
+      mode = no_cs;
+    }
+  }
+  if (ioctl(bus->fd, SPI_IOC_WR_MODE32, &mode) < 0 ||
+      ioctl(bus->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+      ioctl(bus->fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) < 0) {
+    perror(dev);
+    close(bus->fd);
+    bus->fd = -1;
+    return -1;
+  }
+  bus->speed_hz = spi_speed;
+  return bus_id;
+}
+
+static int LinuxSpiTransfer(int bus_id, const SpiXfer_t* xfers, int count)
+{
+  struct spi_ioc_transfer tr[HAL_SPI_MAX_XFERS];
+
+  if (bus_id < 0 || bus_id >= bus_nb || buses[bus_id].fd < 0 || count <= 0 || count > HAL_SPI_MAX_XFERS) {
+    return -1;
+  }
+  SpiBus_t* bus = &buses[bus_id];
+
+  memset(tr, 0, sizeof(tr));
+  for (int i = 0; i < count; i++) {
+    tr[i].tx_buf = (unsigned long)xfers[i].tx;
+    tr[i].rx_buf = (unsigned long)xfers[i].rx;
+    tr[i].len = xfers[i].len;
+    tr[i].speed_hz = bus->speed_hz;
+    tr[i].bits_per_word = 8;
+    // release chip select between transfers, the last one ends the message
+    tr[i].cs_change = (i < count - 1) ? 1 : 0;
+  }
+
+  if (bus->cs_line < 0) {
+    return ioctl(bus->fd, SPI_IOC_MESSAGE(count), tr) < 0 ? -1 : 0;
+  }
+
+  int ret = 0;
+  pthread_mutex_lock(&cs_lock);
+  for (int i = 0; i < count && ret >= 0; i++) {
+    tr[i].cs_change = 0;
+    SetLine(bus->cs_line, HAL_LOW);
+    ret = ioctl(bus->fd, SPI_IOC_MESSAGE(1), &tr[i]);
+    SetLine(bus->cs_line, HAL_HIGH);
+  }
+  pthread_mutex_unlock(&cs_lock);
+  return ret < 0 ? -1 : 0;
+}
+
+static int LinuxSpiSetSpeed(int bus_id, uint32_t spi_speed)
+{
+  if (bus_id < 0 || bus_id >= bus_nb || buses[bus_id].fd < 0) {
+    return -1;
+  }
+  if (ioctl(buses[bus_id].fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) < 0) {
+    return -1;
+  }
+  // also set per transfer, see LinuxSpiTransfer()
+  buses[bus_id].speed_hz = spi_speed;
+  return 0;
+}
+
+static void LinuxPinMode(int pin, int mode, int value)
+{
+  int bcm = WpiToBcm(pin);
+  if (bcm < 0) {
+    return;
+  }
+  RequestLine(bcm, mode == HAL_OUTPUT ? GPIO_V2_LINE_FLAG_OUTPUT : GPIO_V2_LINE_FLAG_INPUT, value);
+}
+
+static void LinuxDigitalWrite(int pin, int value)
+{
+  int bcm = WpiToBcm(pin);
+  if (bcm < 0 || !line_init || line_fd[bcm] < 0) {
+    return;
+  }
+  SetLine(bcm, value);
+}
+
+static int LinuxDigitalRead(int pin)
+{
+  int bcm = WpiToBcm(pin);
+  if (bcm < 0 || !line_init || line_fd[bcm] < 0) {
+    return HAL_LOW;
+  }
+
+  struct gpio_v2_line_values values;
+  values.mask = 1;
+  values.bits = 0;
+  if (ioctl(line_fd[bcm], GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+    return HAL_LOW;
+  }
+  return (values.bits & 1) ? HAL_HIGH : HAL_LOW;
+}
+
+static void LinuxDelayMs(unsigned int ms)
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+  }
+}
+
+static int LinuxIrqEnable(int pin)
+{
+  int bcm = WpiToBcm(pin);
+  if (bcm < 0) {
+    return -1;
+  }
+  return RequestLine(bcm, GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING, HAL_LOW);
+}
+
+static int LinuxIrqAck(int pin, uint64_t* p_timestamp_ns)
+{
+  int bcm = WpiToBcm(pin);
+  if (bcm < 0 || !line_init || line_fd[bcm] < 0) {
+    return -1;
+  }
+
+  struct gpio_v2_line_event events[16];
+  ssize_t len = read(line_fd[bcm], events, sizeof(events));
+  if (len < (ssize_t)sizeof(events[0])) {
+    return -1;
+  }
+  int count = len / sizeof(events[0]);
+  // default event clock is CLOCK_MONOTONIC
+  *p_timestamp_ns = events[count - 1].timestamp_ns;
+  return count;
+}
+
+const Hal_t hal_linux = {
+  "linux",
+  LinuxOpen,
+  LinuxSpiTransfer,
+  LinuxSpiSetSpeed,
+  LinuxPinMode,
+  LinuxDigitalWrite,
+  LinuxDigitalRead,
+  LinuxDelayMs,
+  LinuxIrqEnable,
+  LinuxIrqAck,
+};
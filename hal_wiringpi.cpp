@@ -0,0 +1,168 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// wiringPi backend, built with `make WIRINGPI=1`.
+// One wiringPiSPIDataRW() per transfer, NSS driven as a GPIO under a lock
+// shared by all radios.
+
+#include "hal.h"
+
+#include <wiringPi.h>
+#include <wiringPiSPI.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstring>
+
+typedef struct SpiBus
+{
+  int channel;
+  int nss;
+} SpiBus_t;
+
+static SpiBus_t buses[HAL_MAX_BUSES];
+static int bus_nb = 0;
+static pthread_mutex_t spi_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int WiringPiOpen(int channel, uint32_t spi_speed, int nss_pin)
+{
+  int bus_id = -1;
+
+  // radios may be set up in parallel
+  pthread_mutex_lock(&spi_lock);
+  if (bus_nb < HAL_MAX_BUSES) {
+    if (bus_nb == 0) {
+      wiringPiSetup();
+    }
+    buses[bus_nb].channel = channel;
+    buses[bus_nb].nss = nss_pin;
+    // the output latch is set first, so NSS never goes low
+    digitalWrite(nss_pin, HIGH);
+    pinMode(nss_pin, OUTPUT);
+    if (wiringPiSPISetup(channel, spi_speed) >= 0) {
+      bus_id = bus_nb++;
+    }
+  }
+  pthread_mutex_unlock(&spi_lock);
+  return bus_id;
+}
+
+static int WiringPiSpiTransfer(int bus_id, const SpiXfer_t* xfers, int count)
+{
+  uint8_t spibuf[HAL_SPI_MAX_LEN];
+
+  if (bus_id < 0 || bus_id >= bus_nb) {
+    return -1;
+  }
+  int channel = buses[bus_id].channel;
+  int nss = buses[bus_id].nss;
+
+  for (int i = 0; i < count; i++) {
+    int len = xfers[i].len;
+    if (len > HAL_SPI_MAX_LEN) {
+      return -1;
+    }
+    // wiringPiSPIDataRW works in place
+    if (xfers[i].tx != NULL) {
+      memcpy(spibuf, xfers[i].tx, len);
+    } else {
+      memset(spibuf, 0x00, len);
+    }
+
+    pthread_mutex_lock(&spi_lock);
+    digitalWrite(nss, LOW);
+    int ret = wiringPiSPIDataRW(channel, spibuf, len);
+    digitalWrite(nss, HIGH);
+    pthread_mutex_unlock(&spi_lock);
+    if (ret < 0) {
+      return -1;
+    }
+
+    if (xfers[i].rx != NULL) {
+      memcpy(xfers[i].rx, spibuf, len);
+    }
+  }
+  return 0;
+}
+
+// wiringPiSPIDataRW() takes the clock stored by wiringPiSPISetup(), so
+// set the channel up again
+static int WiringPiSpiSetSpeed(int bus_id, uint32_t spi_speed)
+{
+  if (bus_id < 0 || bus_id >= bus_nb) {
+    return -1;
+  }
+  int channel = buses[bus_id].channel;
+
+  pthread_mutex_lock(&spi_lock);
+  close(wiringPiSPIGetFd(channel));
+  int ret = wiringPiSPISetup(channel, spi_speed);
+  pthread_mutex_unlock(&spi_lock);
+  return ret < 0 ? -1 : 0;
+}
+
+static void WiringPiPinMode(int pin, int mode, int value)
+{
+  if (pin != HAL_PIN_UNUSED) {
+    if (mode == HAL_OUTPUT) {
+      digitalWrite(pin, value ? HIGH : LOW);
+    }
+    // read-modify-write of a function select register shared by 10 pins
+    pthread_mutex_lock(&spi_lock);
+    pinMode(pin, mode == HAL_OUTPUT ? OUTPUT : INPUT);
+    pthread_mutex_unlock(&spi_lock);
+  }
+}
+
+static void WiringPiDigitalWrite(int pin, int value)
+{
+  if (pin != HAL_PIN_UNUSED) {
+    digitalWrite(pin, value ? HIGH : LOW);
+  }
+}
+
+static int WiringPiDigitalRead(int pin)
+{
+  if (pin == HAL_PIN_UNUSED) {
+    return HAL_LOW;
+  }
+  return digitalRead(pin) ? HAL_HIGH : HAL_LOW;
+}
+
+static void WiringPiDelayMs(unsigned int ms)
+{
+  delay(ms);
+}
+
+// wiringPiISR() only offers a callback thread, leave DIO0 to level polling
+static int WiringPiIrqEnable(int pin)
+{
+  return -1;
+}
+
+static int WiringPiIrqAck(int pin, uint64_t* p_timestamp_ns)
+{
+  return 0;
+}
+
+const Hal_t hal_wiringpi = {
+  "wiringpi",
+  WiringPiOpen,
+  WiringPiSpiTransfer,
+  WiringPiSpiSetSpeed,
+  WiringPiPinMode,
+  WiringPiDigitalWrite,
+  WiringPiDigitalRead,
+  WiringPiDelayMs,
+  WiringPiIrqEnable,
+  WiringPiIrqAck,
+};
@@ -0,0 +1,106 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Bounded single producer / single consumer ring of preallocated records,
+// the hand-off between the forwarder threads.
+//
+// The producer claims the next free record, fills it in place and publishes
+// it. The consumer looks at the oldest published record and releases it
+// once done. Neither side ever blocks or takes a lock: a full ring makes
+// Claim() fail and counts a drop. Publishing also writes an eventfd, which
+// may be shared by several rings, so that the consumer can sleep in poll()
+// or epoll_wait().
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+
+template<typename T, uint32_t N>
+struct SpscRing
+{
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+  T slot[N];
+  std::atomic<uint32_t> head;       /* next record to publish, producer side */
+  std::atomic<uint32_t> tail;       /* next record to release, consumer side */
+  std::atomic<uint32_t> dropped;    /* claims refused, since start */
+  std::atomic<uint32_t> depth_max;  /* deepest backlog seen by the consumer */
+  int efd;
+
+  void Init(int event_fd)
+  {
+    head.store(0);
+    tail.store(0);
+    dropped.store(0);
+    depth_max.store(0);
+    efd = event_fd;
+  }
+
+  // Producer: record to fill, NULL if the ring is full
+  T* Claim()
+  {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return NULL;
+    }
+    return &slot[h % N];
+  }
+
+  // Producer: hand the claimed record over
+  void Publish()
+  {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0) {
+      // counter saturated, the consumer has a wake up pending anyway
+    }
+  }
+
+  // Consumer: oldest published record, NULL if none
+  T* Front()
+  {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t depth = head.load(std::memory_order_acquire) - t;
+    if (depth == 0) {
+      return NULL;
+    }
+    if (depth > depth_max.load(std::memory_order_relaxed)) {
+      depth_max.store(depth, std::memory_order_relaxed);
+    }
+    return &slot[t % N];
+  }
+
+  // Consumer: done with the record Front() returned
+  void Release()
+  {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Either side: records published and not yet released
+  uint32_t Depth()
+  {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+};
+
+// eventfd for Init(), several rings may share it
+inline int RingEventFd()
+{
+  return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+#endif // _RING_H
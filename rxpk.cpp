@@ -0,0 +1,134 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "rxpk.h"
+
+#include "base64.h"
+
+#include <cstring>
+
+// bin_to_b64() wants a spare byte to pad 253 and 254 byte frames
+#define BASE64_MAX_LENGTH 342
+
+char* RxpkPutStr(char* p, const char* str)
+{
+  while (*str != '\0') {
+    *p++ = *str++;
+  }
+  return p;
+}
+
+static char* PutUint(char* p, uint32_t value)
+{
+  char digits[10];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  while (n > 0) {
+    *p++ = digits[--n];
+  }
+  return p;
+}
+
+static char* PutInt(char* p, int32_t value)
+{
+  if (value < 0) {
+    *p++ = '-';
+    return PutUint(p, (uint32_t)-(int64_t)value);
+  }
+  return PutUint(p, value);
+}
+
+// Hz as shortest MHz decimal, like writer.Double(freq / 1e6): 868.1, 869.525
+static char* PutMhz(char* p, uint32_t freq)
+{
+  uint32_t frac = freq % 1000000;
+  int digits = 6;
+
+  p = PutUint(p, freq / 1000000);
+  *p++ = '.';
+  while (digits > 1 && frac % 10 == 0) {
+    frac /= 10;
+    digits--;
+  }
+  for (int i = digits - 1; i >= 0; i--) {
+    p[i] = '0' + frac % 10;
+    frac /= 10;
+  }
+  return p + digits;
+}
+
+static int ChanText(char* p, uint32_t freq, int chan, int rfch)
+{
+  char* start = p;
+  p = RxpkPutStr(p, ",\"freq\":");
+  p = PutMhz(p, freq);
+  p = RxpkPutStr(p, ",\"chan\":");
+  p = PutUint(p, chan);
+  p = RxpkPutStr(p, ",\"rfch\":");
+  p = PutUint(p, rfch);
+  p = RxpkPutStr(p, ",\"stat\":1,\"modu\":\"LORA\",\"datr\":\"");
+  return p - start;
+}
+
+void RxpkChanInit(RxpkChan_t* c, uint32_t freq, int chan, int rfch)
+{
+  c->freq = freq;
+  c->len = ChanText(c->text, freq, chan, rfch);
+}
+
+char* RxpkPut(char* p, const RxPacket_t* p_pkt, const RxpkChan_t* c)
+{
+  long int SNR;
+  int rssicorr;
+
+  uint8_t value = p_pkt->meta.snr;
+  if (value & 0x80) { // The SNR sign bit is 1
+    // Invert and divide by 4
+    value = ((~value + 1) & 0xFF) >> 2;
+    SNR = -value;
+  } else {
+    // Divide by 4
+    SNR = ( value & 0xFF ) >> 2;
+  }
+
+  rssicorr = p_pkt->sx1272 ? 139 : 157;
+
+  // Free running 32 bit us counter taken at RxDone, wraps every ~71 min
+  uint32_t tmst = (uint32_t)(p_pkt->irq_ns / 1000);
+
+  p = RxpkPutStr(p, "{\"tmst\":");
+  p = PutUint(p, tmst);
+  if (c->freq == p_pkt->freq) {
+    memcpy(p, c->text, c->len);
+    p += c->len;
+  } else {
+    p += ChanText(p, p_pkt->freq, p_pkt->chan, p_pkt->rfch);
+  }
+  p = RxpkPutStr(p, p_pkt->modem_conf->datr);
+  p = RxpkPutStr(p, "\",\"codr\":\"");
+  p = RxpkPutStr(p, p_pkt->modem_conf->codr);
+  p = RxpkPutStr(p, "\",\"rssi\":");
+  p = PutInt(p, p_pkt->meta.pkt_rssi - rssicorr);
+  p = RxpkPutStr(p, ",\"lsnr\":");
+  p = PutInt(p, SNR);
+  p = RxpkPutStr(p, ".0,\"size\":");
+  p = PutUint(p, p_pkt->length);
+  p = RxpkPutStr(p, ",\"data\":\"");
+  // Encode payload.
+  int b64_len = bin_to_b64(p_pkt->payload, p_pkt->length, p, BASE64_MAX_LENGTH);
+  if (b64_len < 0) {
+    return NULL;
+  }
+  return RxpkPutStr(p + b64_len, "\"}");
+}
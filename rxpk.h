@@ -0,0 +1,44 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// rxpk JSON objects written straight into the PUSH_DATA datagram, with the
+// same text rapidjson's Writer produced. The text that only depends on the
+// channel is built once per channel, so that a frame only costs its own
+// values and its base64 payload, without heap allocations or copies.
+
+#ifndef _RXPK_H
+#define _RXPK_H
+
+#include "sx127x.h"
+
+#include <cstdint>
+
+// Longest rxpk object without its base64 data
+#define RXPK_MAX_FIXED  192
+
+typedef struct RxpkChan
+{
+  uint32_t freq;
+  int len;
+  char text[96];    /* ,"freq":..,"chan":..,"rfch":..,"stat":1,"modu":"LORA","datr":" */
+} RxpkChan_t;
+
+// Fills in c for a channel
+void RxpkChanInit(RxpkChan_t* c, uint32_t freq, int chan, int rfch);
+
+// Writes the rxpk object of p_pkt at p and returns its end, or NULL if the
+// payload could not be encoded. c is the channel it came in on, its text is
+// used when the frequency matches.
+char* RxpkPut(char* p, const RxPacket_t* p_pkt, const RxpkChan_t* c);
+
+char* RxpkPutStr(char* p, const char* str);
+
+#endif // _RXPK_H
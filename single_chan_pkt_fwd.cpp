@@ -13,28 +13,42 @@
 // Pin number in this global_conf.json are Wiring Pi number (wPi colunm)
 // issue a `gpio readall` on PI command line to see mapping
 
-#include "base64.h"
+#include "hal.h"
+#include "ring.h"
+#include "rxpk.h"
+#include "sx127x.h"
 
 #include <rapidjson/document.h>
 #include <rapidjson/filereadstream.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
-#include <wiringPi.h>
-#include <wiringPiSPI.h>
-
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <malloc.h>
 #include <netdb.h>
+#include <unistd.h>
 
+#include <cerrno>
+#include <cstddef>
 #include <cstdlib>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -43,15 +57,7 @@ using namespace std;
 
 using namespace rapidjson;
 
-#define BASE64_MAX_LENGTH 341
-
-static const int SPI_CHANNEL = 0;
-
-bool sx1272 = true;
-
-struct sockaddr_in si_other;
 int s = 0;
-int slen = sizeof(si_other);
 struct ifreq ifr;
 
 uint32_t cp_nb_rx_rcv;
@@ -61,34 +67,114 @@ uint32_t cp_nb_rx_bad;
 uint32_t cp_nb_rx_nocrc;
 uint32_t cp_up_pkt_fwd;
 
-typedef enum SpreadingFactors
+// RxDone edge to end of FIFO drain, in us, over the last status interval.
+// This is the error a tmst sampled after the SPI reads would carry.
+uint32_t rx_lat_nb;
+uint32_t rx_lat_min;
+uint32_t rx_lat_max;
+uint64_t rx_lat_sum;
+// Same since start, by bucket: < 50, 100, 200, 500 us, 1, 2, 5 ms, more
+#define RX_LAT_HIST_SIZE 8
+static const uint32_t rx_lat_hist_us[RX_LAT_HIST_SIZE - 1] = { 50, 100, 200, 500, 1000, 2000, 5000 };
+uint32_t rx_lat_hist[RX_LAT_HIST_SIZE];
+// Frames without an RxDone edge, left out of the above, since start
+uint32_t rx_est_nb;
+uint32_t rx_est_err_max;        /* us, worst error bound of their tmst */
+
+// Time ForwardPacket() takes to build the rxpk datagram, in ns
+uint32_t rxpk_ns_nb;
+uint64_t rxpk_ns_sum;
+// Frames whose payload could not be base64 encoded, since start
+uint32_t rxpk_drop;
+
+// PUSH_DATA batching: rxpk objects share a datagram until it would grow
+// past batch_bytes or the oldest one has waited batch_ms
+uint32_t batch_ms = 0;            // 0 = one datagram per frame
+uint32_t batch_bytes = 1400;
+
+// Datagrams sent since start, by number of rxpk: 1, 2, 3-4, 5-8, 9+
+#define BATCH_HIST_SIZE 5
+uint32_t batch_hist[BATCH_HIST_SIZE];
+// rxpk of the datagrams the full upstream ring dropped, since start
+uint32_t batch_spill_rxpk;
+
+// PUSH_DATA datagrams waiting for their PUSH_ACK, per server
+#define ACK_INFLIGHT    16
+#define ACK_TIMEOUT_MS  2000
+// Upstream round trip buckets: < 10, 20, 50, 100, 200, 500, 1000 ms, more
+#define RTT_HIST_SIZE   8
+static const uint32_t rtt_hist_ms[RTT_HIST_SIZE - 1] = { 10, 20, 50, 100, 200, 500, 1000 };
+
+typedef struct Inflight
+{
+  bool used;
+  uint16_t token;
+  struct sockaddr_in to;    /* where it went, the ACK must come from there */
+  uint64_t sent_ns;
+} Inflight_t;
+
+// Acknowledgement bookkeeping, inflight belongs to the network thread, the
+// counters cover the status interval and are guarded by net_lock
+typedef struct ServerAck
 {
-    SF7 = 7,
-    SF8 = 8,
-    SF9 = 9,
-    SF10 = 10,
-    SF11 = 11,
-    SF12 = 12
-} SpreadingFactor_t;
+  Inflight_t inflight[ACK_INFLIGHT];
+  uint32_t push_nb;         /* PUSH_DATA sent */
+  uint32_t ack_nb;          /* matching PUSH_ACK received */
+  uint32_t lost_nb;         /* no PUSH_ACK within ACK_TIMEOUT_MS */
+  uint32_t rtt_hist[RTT_HIST_SIZE];
+} ServerAck_t;
 
 typedef struct Server
 {
     string address;
     uint16_t port;
     bool enabled;
+    // Set by ResolveServer(), under dns_lock
+    bool resolved;
+    struct sockaddr_in addr;
+    uint32_t dns_fail;        /* lookups that failed */
+    uint64_t dns_due_ns;      /* next lookup, MonotonicNs() time */
+    // Under net_lock
+    uint32_t dns_drop;        /* datagrams not sent, never resolved */
+    uint32_t send_fail;       /* datagrams the socket refused */
+    int send_errno;           /* reason of the last refusal */
+    ServerAck_t ack;
 } Server_t;
 
+// Server addresses are looked up at startup, then refreshed in the
+// background by DnsThread() so that sends only copy the cached sockaddr.
+// getaddrinfo() does not tell the record TTL, the refresh period is fixed.
+uint32_t dns_refresh_s = 300;
+#define DNS_RETRY_S 10     // after a failed lookup
+pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dns_cond;   // wakes DnsThread() up early, see DnsRefresh()
+
+// Send and acknowledgement counters, written by the network thread and read
+// by SendStat()
+pthread_mutex_t net_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Startup runs as independent stages in parallel, each one timed
+typedef struct Stage
+{
+  char name[24];
+  bool (*run)(void* arg);
+  void* arg;
+  bool required;       /* startup fails with it */
+  bool ok;
+  uint64_t elapsed_ns;
+  pthread_t thread;
+} Stage_t;
+
 /*******************************************************************************
  *
  * Default values, configure them in global_conf.json
  *
  *******************************************************************************/
 
-// SX1272 - Raspberry connections
-// Put them in global_conf.json
-int nssPin = 0xff;
-int dio0  = 0xff;
-int rstPin   = 0xff;
+// SX127x modules, "SX127x_conf" in global_conf.json is one radio object or
+// an array of them. The index is the rxpk "rfch".
+Radio_t radios[RADIO_MAX];
+int radio_nb = 0;
 
 // Set location in global_conf.json
 float lat =  0.0;
@@ -102,12 +188,6 @@ char eui[8*3+1] = "";
 char if_name[IFNAMSIZ] = "eth0";
 char description[64] ; /* used for free form description */
 
-// Set spreading factor (SF7 - SF12), &nd  center frequency
-// Overwritten by the ones set in global_conf.json
-SpreadingFactor_t sf = SF7;
-uint16_t bw = 125;
-uint32_t freq = 868100000; // in Mhz! (868.1)
-
 
 // Servers
 vector<Server_t> servers;
@@ -115,65 +195,6 @@ vector<Server_t> servers;
 // #############################################
 // #############################################
 
-#define REG_FIFO                    0x00
-#define REG_FIFO_ADDR_PTR           0x0D
-#define REG_FIFO_TX_BASE_AD         0x0E
-#define REG_FIFO_RX_BASE_AD         0x0F
-#define REG_RX_NB_BYTES             0x13
-#define REG_OPMODE                  0x01
-#define REG_FIFO_RX_CURRENT_ADDR    0x10
-#define REG_IRQ_FLAGS               0x12
-#define REG_DIO_MAPPING_1           0x40
-#define REG_DIO_MAPPING_2           0x41
-#define REG_MODEM_CONFIG            0x1D
-#define REG_MODEM_CONFIG2           0x1E
-#define REG_MODEM_CONFIG3           0x26
-#define REG_SYMB_TIMEOUT_LSB        0x1F
-#define REG_PKT_SNR_VALUE           0x19
-#define REG_PAYLOAD_LENGTH          0x22
-#define REG_IRQ_FLAGS_MASK          0x11
-#define REG_MAX_PAYLOAD_LENGTH      0x23
-#define REG_HOP_PERIOD              0x24
-#define REG_SYNC_WORD               0x39
-#define REG_VERSION                 0x42
-
-#define SX72_MODE_RX_CONTINUOS      0x85
-#define SX72_MODE_TX                0x83
-#define SX72_MODE_SLEEP             0x80
-#define SX72_MODE_STANDBY           0x81
-
-
-#define PAYLOAD_LENGTH              0x40
-
-// LOW NOISE AMPLIFIER
-#define REG_LNA                     0x0C
-#define LNA_MAX_GAIN                0x23
-#define LNA_OFF_GAIN                0x00
-#define LNA_LOW_GAIN                0x20
-
-// CONF REG
-#define REG1                        0x0A
-#define REG2                        0x84
-
-#define SX72_MC2_FSK                0x00
-#define SX72_MC2_SF7                0x70
-#define SX72_MC2_SF8                0x80
-#define SX72_MC2_SF9                0x90
-#define SX72_MC2_SF10               0xA0
-#define SX72_MC2_SF11               0xB0
-#define SX72_MC2_SF12               0xC0
-
-#define SX72_MC1_LOW_DATA_RATE_OPTIMIZE  0x01 // mandated for SF11 and SF12
-
-// FRF
-#define REG_FRF_MSB              0x06
-#define REG_FRF_MID              0x07
-#define REG_FRF_LSB              0x08
-
-#define FRF_MSB                  0xD9 // 868.1 Mhz
-#define FRF_MID                  0x06
-#define FRF_LSB                  0x66
-
 #define BUFLEN 2048  //Max length of buffer
 
 #define PROTOCOL_VERSION  1
@@ -187,6 +208,24 @@ vector<Server_t> servers;
 #define TX_BUFF_SIZE    2048
 #define STATUS_SIZE     1024
 
+#define STAT_INTERVAL   5   // seconds between status reports
+
+// The forwarder is a pipeline: each radio thread only drains its FIFO into
+// its uplink ring, the main thread turns the frames into PUSH_DATA records
+// of the upstream ring, and NetThread() sends them and collects the ACKs.
+// A stalled stage fills its ring and drops, it never blocks the one before.
+#define UPLINK_RING_SIZE    32
+#define UPSTREAM_RING_SIZE  16
+
+typedef struct Datagram
+{
+  int len;
+  char data[TX_BUFF_SIZE];
+} Datagram_t;
+
+SpscRing<RxPacket_t, UPLINK_RING_SIZE> uplink[RADIO_MAX];  // all on one eventfd
+SpscRing<Datagram_t, UPSTREAM_RING_SIZE> upstream;
+
 void LoadConfiguration(string filename);
 void PrintConfiguration();
 
@@ -196,209 +235,265 @@ void Die(const char *s)
   exit(1);
 }
 
-void SelectReceiver()
+bool SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin)
 {
-  digitalWrite(nssPin, LOW);
-}
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
 
-void UnselectReceiver()
-{
-  digitalWrite(nssPin, HIGH);
-}
+  char service[6] = { '\0' };
+  snprintf(service, 6, "%hu", port);
 
-uint8_t ReadRegister(uint8_t addr)
-{
-  uint8_t spibuf[2];
-  spibuf[0] = addr & 0x7F;
-  spibuf[1] = 0x00;
+  struct addrinfo* p_result = NULL;
 
-  SelectReceiver();
-  wiringPiSPIDataRW(SPI_CHANNEL, spibuf, 2);
-  UnselectReceiver();
+  // Resolve the domain name into a list of addresses
+  int error = getaddrinfo(p_hostname, service, &hints, &p_result);
+  if (error != 0) {
+      fprintf(stderr, "getaddrinfo: %s: %s\n", p_hostname, gai_strerror(error));
+      return false;
+  }
 
-  return spibuf[1];
-}
+  memset(p_sin, 0, sizeof(*p_sin));
+  p_sin->sin_family = AF_INET;
+  p_sin->sin_port = htons(port);
 
-void WriteRegister(uint8_t addr, uint8_t value)
-{
-  uint8_t spibuf[2];
-  spibuf[0] = addr | 0x80;
-  spibuf[1] = value;
+  // Loop over all returned results
+  for (struct addrinfo* p_rp = p_result; p_rp != NULL; p_rp = p_rp->ai_next) {
+    struct sockaddr_in* p_saddr = (struct sockaddr_in*)p_rp->ai_addr;
+    //printf("%s solved to %s\n", p_hostname, inet_ntoa(p_saddr->sin_addr));
+    p_sin->sin_addr = p_saddr->sin_addr;
+  }
 
-  SelectReceiver();
-  wiringPiSPIDataRW(SPI_CHANNEL, spibuf, 2);
-  UnselectReceiver();
+  freeaddrinfo(p_result);
+  return true;
 }
 
-bool ReceivePkt(char* payload, uint8_t* p_length)
+// Look the server up again and update the cache. A failure keeps the
+// last known address, if any, and schedules a retry.
+bool ResolveServer(Server_t* p_server)
 {
-  // clear rxDone
-  WriteRegister(REG_IRQ_FLAGS, 0x40);
-
-  int irqflags = ReadRegister(REG_IRQ_FLAGS);
-
-  cp_nb_rx_rcv++;
-
-  //  payload crc: 0x20
-  if((irqflags & 0x20) == 0x20) {
-    printf("CRC error\n");
-    WriteRegister(REG_IRQ_FLAGS, 0x20);
-    return false;
+  struct sockaddr_in addr;
+  bool ok = SolveHostname(p_server->address.c_str(), p_server->port, &addr);
 
+  pthread_mutex_lock(&dns_lock);
+  if (ok) {
+    p_server->addr = addr;
+    p_server->resolved = true;
   } else {
-    cp_nb_rx_ok++;
-    cp_nb_rx_ok_tot++;
-
-    uint8_t currentAddr = ReadRegister(REG_FIFO_RX_CURRENT_ADDR);
-    uint8_t receivedCount = ReadRegister(REG_RX_NB_BYTES);
-    *p_length = receivedCount;
-   printf( "Rx data size %d\r\n", receivedCount);
-
-    WriteRegister(REG_FIFO_ADDR_PTR, currentAddr);
+    p_server->dns_fail++;
+  }
+  p_server->dns_due_ns = MonotonicNs() + (uint64_t)(ok ? dns_refresh_s : DNS_RETRY_S) * 1000000000ULL;
+  pthread_mutex_unlock(&dns_lock);
+  return ok;
+}
 
-    for(int i = 0; i < receivedCount; i++) {
-      payload[i] = ReadRegister(REG_FIFO);
+void* DnsThread(void* arg)
+{
+  while (1) {
+    uint64_t now = MonotonicNs();
+    uint64_t next = now + (uint64_t)DNS_RETRY_S * 1000000000ULL;
+    for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      if (!it->enabled) {
+        continue;
+      }
+      pthread_mutex_lock(&dns_lock);
+      uint64_t due = it->dns_due_ns;
+      pthread_mutex_unlock(&dns_lock);
+      if (due <= now) {
+        ResolveServer(&*it);
+        pthread_mutex_lock(&dns_lock);
+        due = it->dns_due_ns;
+        pthread_mutex_unlock(&dns_lock);
+      }
+      if (due < next) {
+        next = due;
+      }
     }
+    struct timespec ts;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    pthread_mutex_lock(&dns_lock);
+    pthread_cond_timedwait(&dns_cond, &dns_lock, &ts);
+    pthread_mutex_unlock(&dns_lock);
   }
-  return true;
+  return NULL;
 }
 
-char * PinName(int pin, char * buff) {
-  strcpy(buff, "unused");
-  if (pin != 0xff) {
-    sprintf(buff, "%d", pin);
+// Look every server up again now
+void DnsRefresh()
+{
+  pthread_mutex_lock(&dns_lock);
+  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+    it->dns_due_ns = 0;
   }
-  return buff;
+  pthread_cond_signal(&dns_cond);
+  pthread_mutex_unlock(&dns_lock);
 }
 
-void SetupLoRa()
+// Free the slots whose PUSH_ACK is overdue
+void AckExpire(ServerAck_t* p_ack, uint64_t now)
 {
-  char buff[16];
-
-  printf("Trying to detect module with ");
-  printf("NSS=%s "  , PinName(nssPin, buff));
-  printf("DIO0=%s " , PinName(dio0 , buff));
-  printf("Reset=%s ", PinName(rstPin  , buff));
-  
-  // check basic 
-  if (nssPin == 0xff || dio0 == 0xff) {
-    Die("Bad pin configuration nssPin and dio0 need at least to be defined");
+  for (int i = 0; i < ACK_INFLIGHT; i++) {
+    Inflight_t* f = &p_ack->inflight[i];
+    if (f->used && now - f->sent_ns >= (uint64_t)ACK_TIMEOUT_MS * 1000000) {
+      f->used = false;
+      pthread_mutex_lock(&net_lock);
+      p_ack->lost_nb++;
+      pthread_mutex_unlock(&net_lock);
+    }
   }
+}
 
-  digitalWrite(rstPin, HIGH);
-  delay(100);
-  digitalWrite(rstPin, LOW);
-  delay(100);
-
-  uint8_t version = ReadRegister(REG_VERSION);
-
-  if (version == 0x22) {
-    // sx1272
-    printf("SX1272 detected, starting.\n");
-    sx1272 = true;
-  } else {
-    // sx1276?
-    digitalWrite(rstPin, LOW);
-    delay(100);
-    digitalWrite(rstPin, HIGH);
-    delay(100);
-    version = ReadRegister(REG_VERSION);
-    if (version == 0x12) {
-      // sx1276
-      printf("SX1276 detected, starting.\n");
-      sx1272 = false;
-    } else {
-      printf("Transceiver version 0x%02X\n", version);
-      Die("Unrecognized transceiver");
-    }
-  }
-
-  WriteRegister(REG_OPMODE, SX72_MODE_SLEEP);
-
-  // set frequency
-  uint64_t frf = ((uint64_t)freq << 19) / 32000000;
-  WriteRegister(REG_FRF_MSB, (uint8_t)(frf >> 16) );
-  WriteRegister(REG_FRF_MID, (uint8_t)(frf >> 8) );
-  WriteRegister(REG_FRF_LSB, (uint8_t)(frf >> 0) );
-
-  WriteRegister(REG_SYNC_WORD, 0x34); // LoRaWAN public sync word
-
-  if (sx1272) {
-    if (sf == SF11 || sf == SF12) {
-      WriteRegister(REG_MODEM_CONFIG, 0x0B);
-    } else {
-      WriteRegister(REG_MODEM_CONFIG, 0x0A);
-    }
-    WriteRegister(REG_MODEM_CONFIG2, (sf << 4) | 0x04);
-  } else {
-    if (sf == SF11 || sf == SF12) {
-      WriteRegister(REG_MODEM_CONFIG3, 0x0C);
-    } else {
-      WriteRegister(REG_MODEM_CONFIG3, 0x04);
+// A PUSH_DATA went out to p_server, wait for its ACK
+void AckTrack(Server_t* p_server, uint16_t token, const struct sockaddr_in* p_to, uint64_t now)
+{
+  ServerAck_t* p_ack = &p_server->ack;
+  AckExpire(p_ack, now);
+  // the table is full only at a high rate with acks missing, the oldest
+  // one is then given up
+  Inflight_t* slot = &p_ack->inflight[0];
+  for (int i = 0; i < ACK_INFLIGHT && slot->used; i++) {
+    Inflight_t* f = &p_ack->inflight[i];
+    if (!f->used || f->sent_ns < slot->sent_ns) {
+      slot = f;
     }
-    WriteRegister(REG_MODEM_CONFIG, 0x72);
-    WriteRegister(REG_MODEM_CONFIG2, (sf << 4) | 0x04);
   }
-
-  if (sf == SF10 || sf == SF11 || sf == SF12) {
-    WriteRegister(REG_SYMB_TIMEOUT_LSB, 0x05);
-  } else {
-    WriteRegister(REG_SYMB_TIMEOUT_LSB, 0x08);
+  pthread_mutex_lock(&net_lock);
+  if (slot->used) {
+    p_ack->lost_nb++;
   }
-  WriteRegister(REG_MAX_PAYLOAD_LENGTH, 0x80);
-  WriteRegister(REG_PAYLOAD_LENGTH, PAYLOAD_LENGTH);
-  WriteRegister(REG_HOP_PERIOD, 0xFF);
-  WriteRegister(REG_FIFO_ADDR_PTR, ReadRegister(REG_FIFO_RX_BASE_AD));
-
-  // Set Continous Receive Mode
-  WriteRegister(REG_LNA, LNA_MAX_GAIN);  // max lna gain
-  WriteRegister(REG_OPMODE, SX72_MODE_RX_CONTINUOS);
+  p_ack->push_nb++;
+  pthread_mutex_unlock(&net_lock);
+  slot->used = true;
+  slot->token = token;
+  slot->to = *p_to;
+  slot->sent_ns = now;
 }
 
-void SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin)
+// Match the PUSH_ACKs waiting on the upstream socket
+void AckReceive()
 {
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_protocol = IPPROTO_UDP;
-
-  char service[6] = { '\0' };
-  snprintf(service, 6, "%hu", port);
-
-  struct addrinfo* p_result = NULL;
-
-  // Resolve the domain name into a list of addresses
-  int error = getaddrinfo(p_hostname, service, &hints, &p_result);
-  if (error != 0) {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-      exit(EXIT_FAILURE);
-  }
-
-  // Loop over all returned results
-  for (struct addrinfo* p_rp = p_result; p_rp != NULL; p_rp = p_rp->ai_next) {
-    struct sockaddr_in* p_saddr = (struct sockaddr_in*)p_rp->ai_addr;
-    //printf("%s solved to %s\n", p_hostname, inet_ntoa(p_saddr->sin_addr));
-    p_sin->sin_addr = p_saddr->sin_addr;
+  uint8_t buff_down[64];
+  struct sockaddr_in from;
+
+  while (1) {
+    socklen_t from_len = sizeof(from);
+    ssize_t len = recvfrom(s, buff_down, sizeof(buff_down), MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+    if (len < 0 && errno != EINTR) {
+      return;
+    }
+    uint64_t now = MonotonicNs();
+    if (len < 4 || buff_down[0] != PROTOCOL_VERSION || buff_down[3] != PKT_PUSH_ACK) {
+      continue;
+    }
+    uint16_t token = (buff_down[1] << 8) | buff_down[2];
+
+    for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      ServerAck_t* p_ack = &it->ack;
+      for (int i = 0; i < ACK_INFLIGHT; i++) {
+        Inflight_t* f = &p_ack->inflight[i];
+        if (f->used && f->token == token && f->to.sin_addr.s_addr == from.sin_addr.s_addr && f->to.sin_port == from.sin_port) {
+          uint32_t rtt_ms = (now - f->sent_ns) / 1000000;
+          int bucket = 0;
+          while (bucket < RTT_HIST_SIZE - 1 && rtt_ms >= rtt_hist_ms[bucket]) {
+            bucket++;
+          }
+          pthread_mutex_lock(&net_lock);
+          p_ack->rtt_hist[bucket]++;
+          p_ack->ack_nb++;
+          pthread_mutex_unlock(&net_lock);
+          f->used = false;
+          break;
+        }
+      }
+    }
   }
-
-  freeaddrinfo(p_result);
 }
 
+// Servers per sendmmsg() call
+#define SEND_FANOUT 8
+
+// The same datagram to every enabled server, SEND_FANOUT of them per system
+// call. A refused send is counted against its server and the others still
+// go out. Network thread only.
 void SendUdp(char *msg, int length)
 {
-  for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
-    if (it->enabled) {
-      si_other.sin_port = htons(it->port);
+  struct mmsghdr msgs[SEND_FANOUT];
+  struct sockaddr_in addrs[SEND_FANOUT];
+  Server_t* dests[SEND_FANOUT];
+  struct iovec iov;
+
+  iov.iov_base = msg;
+  iov.iov_len = length;
+
+  vector<Server_t>::iterator it = servers.begin();
+  while (it != servers.end()) {
+    int nb = 0;
+    pthread_mutex_lock(&dns_lock);
+    for (; it != servers.end() && nb < SEND_FANOUT; ++it) {
+      if (!it->enabled) {
+        continue;
+      }
+      // DnsThread() keeps retrying
+      if (!it->resolved) {
+        pthread_mutex_lock(&net_lock);
+        it->dns_drop++;
+        pthread_mutex_unlock(&net_lock);
+        continue;
+      }
+      addrs[nb] = it->addr;
+      dests[nb] = &*it;
+      nb++;
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    memset(msgs, 0, nb * sizeof(msgs[0]));
+    for (int i = 0; i < nb; i++) {
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iov;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-      SolveHostname(it->address.c_str(), it->port, &si_other);
-      if (sendto(s, (char *)msg, length, 0 , (struct sockaddr *) &si_other, slen)==-1) {
-        Die("sendto()");
+    // sendmmsg() stops at the first failing message, skip it and go on
+    int done = 0;
+    while (done < nb) {
+      int ret = sendmmsg(s, msgs + done, nb - done, 0);
+      if (ret <= 0) {
+        pthread_mutex_lock(&net_lock);
+        dests[done]->send_fail++;
+        dests[done]->send_errno = errno;
+        pthread_mutex_unlock(&net_lock);
+        done++;
+        continue;
+      }
+      uint64_t now = MonotonicNs();
+      for (int i = done; i < done + ret; i++) {
+        AckTrack(dests[i], ((uint8_t)msg[1] << 8) | (uint8_t)msg[2], &addrs[i], now);
       }
+      done += ret;
     }
   }
 }
 
+// Per server counters as SendStat() found them
+typedef struct ServerStat
+{
+  uint32_t dns_drop;
+  uint32_t send_fail;
+  int send_errno;
+  uint32_t push_nb;
+  uint32_t ack_nb;
+  uint32_t lost_nb;
+  uint32_t rtt_hist[RTT_HIST_SIZE];
+} ServerStat_t;
+
+void BatchFlush();
+
+// Main thread. The datagram goes through the upstream ring like the rxpk
+// ones, the pending batch is closed first so that it keeps its place.
 void SendStat()
 {
   static char status_report[STATUS_SIZE]; /* status report as a JSON object */
@@ -426,6 +521,41 @@ void SendStat()
   status_report[2] = token_l;
   stat_index = 12; /* 12-byte header */
 
+  // Take the interval counters and restart them, the lock is not held
+  // while printing so that a slow stdout never holds up the network thread.
+  // Datagrams in flight stay tracked.
+  vector<ServerStat_t> stats(servers.size());
+  pthread_mutex_lock(&net_lock);
+  for (size_t i = 0; i < servers.size(); i++) {
+    Server_t* p_server = &servers[i];
+    ServerStat_t* p_stat = &stats[i];
+    p_stat->dns_drop = p_server->dns_drop;
+    p_stat->send_fail = p_server->send_fail;
+    p_stat->send_errno = p_server->send_errno;
+    p_stat->push_nb = p_server->ack.push_nb;
+    p_stat->ack_nb = p_server->ack.ack_nb;
+    p_stat->lost_nb = p_server->ack.lost_nb;
+    memcpy(p_stat->rtt_hist, p_server->ack.rtt_hist, sizeof(p_stat->rtt_hist));
+    p_server->ack.push_nb = 0;
+    p_server->ack.ack_nb = 0;
+    p_server->ack.lost_nb = 0;
+    memset(p_server->ack.rtt_hist, 0, sizeof(p_server->ack.rtt_hist));
+  }
+  pthread_mutex_unlock(&net_lock);
+
+  // PUSH_DATA whose slot was freed over the interval, all servers: the
+  // acknowledged ones out of those acknowledged or given up, in %. The ones
+  // still in flight count in the interval they settle in, so that a datagram
+  // sent just before the report and acked just after never pushes the
+  // rate past 100.
+  uint32_t settled_nb = 0;
+  uint32_t ack_nb = 0;
+  for (size_t i = 0; i < stats.size(); i++) {
+    settled_nb += stats[i].ack_nb + stats[i].lost_nb;
+    ack_nb += stats[i].ack_nb;
+  }
+  double ackr = settled_nb > 0 ? 100.0 * ack_nb / settled_nb : 0;
+
   /* get timestamp for statistics */
   time_t t = time(NULL);
   strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
@@ -451,7 +581,7 @@ void SendStat()
   writer.String("rxfw");
   writer.Uint(cp_up_pkt_fwd);
   writer.String("ackr");
-  writer.Double(0);
+  writer.Double(ackr);
   writer.String("dwnb");
   writer.Uint(0);
   writer.String("txnb");
@@ -477,172 +607,526 @@ void SendStat()
   else {
     printf("status: new packet!\n");
     printf(" %u packet%sreceived\n", cp_nb_rx_ok_tot, cp_nb_rx_ok_tot > 1 ? "s " : " ");
+    for (int i = 0; i < radio_nb; i++) {
+      RadioPrintStats(&radios[i]);
+    }
+    // deepest backlog over the interval, drops since start
+    printf(" queue depth / drops:");
+    for (int i = 0; i < radio_nb; i++) {
+      printf(" radio %d %u/%u,", i, uplink[i].depth_max.exchange(0), uplink[i].dropped.load());
+    }
+    printf(" upstream %u/%u, %u rxpk in the dropped datagrams\n", upstream.depth_max.exchange(0), upstream.dropped.load(),
+           batch_spill_rxpk);
+    for (size_t j = 0; j < servers.size(); j++) {
+      Server_t* p_server = &servers[j];
+      ServerStat_t* p_stat = &stats[j];
+      pthread_mutex_lock(&dns_lock);
+      uint32_t dns_fail = p_server->dns_fail;
+      pthread_mutex_unlock(&dns_lock);
+      if (dns_fail > 0 || p_stat->dns_drop > 0) {
+        printf(" server %s: %u failed lookups, %u datagrams not sent\n", p_server->address.c_str(), dns_fail, p_stat->dns_drop);
+      }
+      if (p_stat->send_fail > 0) {
+        printf(" server %s: %u send errors, last: %s\n", p_server->address.c_str(), p_stat->send_fail, strerror(p_stat->send_errno));
+      }
+      if (p_stat->push_nb > 0) {
+        printf(" server %s:%hu: %u/%u acked, %u lost, RTT ms", p_server->address.c_str(), p_server->port,
+               p_stat->ack_nb, p_stat->push_nb, p_stat->lost_nb);
+        for (int i = 0; i < RTT_HIST_SIZE; i++) {
+          if (i < RTT_HIST_SIZE - 1) {
+            printf(" <%u: %u", rtt_hist_ms[i], p_stat->rtt_hist[i]);
+          } else {
+            printf(" more: %u\n", p_stat->rtt_hist[i]);
+          }
+        }
+      }
+    }
+    if (rx_lat_nb > 0) {
+      printf(" RxDone to FIFO drained: min %u us, avg %u us, max %u us\n",
+             rx_lat_min, (uint32_t)(rx_lat_sum / rx_lat_nb), rx_lat_max);
+    }
+    printf(" RxDone to FIFO drained since start, us");
+    for (int i = 0; i < RX_LAT_HIST_SIZE; i++) {
+      if (i < RX_LAT_HIST_SIZE - 1) {
+        printf(" <%u: %u", rx_lat_hist_us[i], rx_lat_hist[i]);
+      } else {
+        printf(" more: %u\n", rx_lat_hist[i]);
+      }
+    }
+    if (rx_est_nb > 0) {
+      printf(" RxDone time estimated for %u caught up frames, within %u us\n", rx_est_nb, rx_est_err_max);
+    }
+    if (rxpk_ns_nb > 0) {
+      printf(" rxpk built in %u ns on average\n", (uint32_t)(rxpk_ns_sum / rxpk_ns_nb));
+    }
+    if (rxpk_drop > 0) {
+      printf(" %u frames dropped, payload could not be encoded\n", rxpk_drop);
+    }
+    if (batch_ms > 0) {
+      printf(" rxpk per datagram: 1: %u, 2: %u, 3-4: %u, 5-8: %u, 9+: %u\n",
+             batch_hist[0], batch_hist[1], batch_hist[2], batch_hist[3], batch_hist[4]);
+    }
     fflush(stdout);
   }
 
   // Build and send message.
-  memcpy(status_report + 12, json.c_str(), json.size());
-  SendUdp(status_report, stat_index + json.size());
+  BatchFlush();
+  Datagram_t* d = upstream.Claim();
+  if (d != NULL) {
+    memcpy(status_report + 12, json.c_str(), json.size());
+    d->len = stat_index + json.size();
+    memcpy(d->data, status_report, d->len);
+    upstream.Publish();
+  }
 }
 
-bool Receivepacket()
+// Network stage: sends what the main thread queued and matches the
+// PUSH_ACKs, so that neither a slow send nor a stdout stall of the main
+// thread holds up the other
+void* NetThread(void* arg)
 {
-  long int SNR;
-  int rssicorr;
-  bool ret = false;
+  struct pollfd fds[2];
+  fds[0].fd = upstream.efd;
+  fds[0].events = POLLIN;
+  fds[1].fd = s;
+  fds[1].events = POLLIN;
+
+  while (1) {
+    if (poll(fds, 2, ACK_TIMEOUT_MS) < 0 && errno != EINTR) {
+      Die("poll");
+    }
+    uint64_t count;
+    if (read(upstream.efd, &count, sizeof(count)) < 0) {
+      // nothing published, the ring is checked anyway
+    }
+    Datagram_t* d;
+    while ((d = upstream.Front()) != NULL) {
+      SendUdp(d->data, d->len);
+      upstream.Release();
+    }
+    if (fds[1].revents & POLLIN) {
+      AckReceive();
+    }
+    // overdue ACKs count as lost even while nothing is sent
+    uint64_t now = MonotonicNs();
+    for (vector<Server_t>::iterator it = servers.begin(); it != servers.end(); ++it) {
+      AckExpire(&it->ack, now);
+    }
+  }
+  return NULL;
+}
 
-  if (digitalRead(dio0) == 1) {
-    char message[256];
-    uint8_t length = 0;
-    if (ReceivePkt(message, &length)) {
-      // OK got one
-      ret = true;
+void UplinkInit()
+{
+  int efd = RingEventFd();
+  if (efd < 0) {
+    Die("eventfd");
+  }
+  for (int i = 0; i < RADIO_MAX; i++) {
+    uplink[i].Init(efd);
+  }
+}
 
-      uint8_t value = ReadRegister(REG_PKT_SNR_VALUE);
-      if (value & 0x80) { // The SNR sign bit is 1
-        // Invert and divide by 4
-        value = ((~value + 1) & 0xFF) >> 2;
-        SNR = -value;
-      } else {
-        // Divide by 4
-        SNR = ( value & 0xFF ) >> 2;
-      }
+// RxHandler_t of every radio, runs on the radio threads. Never blocks nor
+// locks: when the main thread falls behind the frame is dropped.
+void UplinkPush(const RxPacket_t* p_pkt)
+{
+  SpscRing<RxPacket_t, UPLINK_RING_SIZE>* ring = &uplink[p_pkt->rfch];
+  RxPacket_t* slot = ring->Claim();
+  if (slot == NULL) {
+    return;
+  }
+  memcpy(slot, p_pkt, offsetof(RxPacket_t, payload) + p_pkt->length);
+  ring->Publish();
+}
 
-      rssicorr = sx1272 ? 139 : 157;
-      printf("incoming packet...\n");
-
-      char buff_up[TX_BUFF_SIZE]; /* buffer to compose the upstream packet */
-      int buff_index = 0;
-
-      /* gateway <-> MAC protocol variables */
-      //static uint32_t net_mac_h; /* Most Significant Nibble, network order */
-      //static uint32_t net_mac_l; /* Least Significant Nibble, network order */
-
-      /* pre-fill the data buffer with fixed fields */
-      buff_up[0] = PROTOCOL_VERSION;
-      buff_up[3] = PKT_PUSH_DATA;
-
-      /* process some of the configuration variables */
-      //net_mac_h = htonl((uint32_t)(0xFFFFFFFF & (lgwm>>32)));
-      //net_mac_l = htonl((uint32_t)(0xFFFFFFFF &  lgwm  ));
-      //*(uint32_t *)(buff_up + 4) = net_mac_h; 
-      //*(uint32_t *)(buff_up + 8) = net_mac_l;
-
-      buff_up[4] = (uint8_t)ifr.ifr_hwaddr.sa_data[0];
-      buff_up[5] = (uint8_t)ifr.ifr_hwaddr.sa_data[1];
-      buff_up[6] = (uint8_t)ifr.ifr_hwaddr.sa_data[2]; 
-      buff_up[7] = 0xFF;
-      buff_up[8] = 0xFF;
-      buff_up[9] = (uint8_t)ifr.ifr_hwaddr.sa_data[3];
-      buff_up[10] = (uint8_t)ifr.ifr_hwaddr.sa_data[4];
-      buff_up[11] = (uint8_t)ifr.ifr_hwaddr.sa_data[5];
-
-      /* start composing datagram with the header */
-      uint8_t token_h = (uint8_t)rand(); /* random token */
-      uint8_t token_l = (uint8_t)rand(); /* random token */
-      buff_up[1] = token_h;
-      buff_up[2] = token_l;
-      buff_index = 12; /* 12-byte header */
-
-      // TODO: tmst can jump is time is (re)set, not good.
-      struct timeval now;
-      gettimeofday(&now, NULL);
-      uint32_t tmst = (uint32_t)(now.tv_sec * 1000000 + now.tv_usec);
-
-      // Encode payload.
-      char b64[BASE64_MAX_LENGTH];
-      bin_to_b64((uint8_t*)message, length, b64, BASE64_MAX_LENGTH);
-
-      // Build JSON object.
-      StringBuffer sb;
-      Writer<StringBuffer> writer(sb);
-      writer.StartObject();
-      writer.String("rxpk");
-      writer.StartArray();
-      writer.StartObject();
-      writer.String("tmst");
-      writer.Uint(tmst);
-      writer.String("freq");
-      writer.Double((double)freq / 1000000);
-      writer.String("chan");
-      writer.Uint(0);
-      writer.String("rfch");
-      writer.Uint(0);
-      writer.String("stat");
-      writer.Uint(1);
-      writer.String("modu");
-      writer.String("LORA");
-      writer.String("datr");
-      char datr[] = "SFxxBWxxx";
-      snprintf(datr, strlen(datr) + 1, "SF%hhuBW%hu", sf, bw);
-      writer.String(datr);
-      writer.String("codr");
-      writer.String("4/5");
-      writer.String("rssi");
-      writer.Int(ReadRegister(0x1A) - rssicorr);
-      writer.String("lsnr");
-      writer.Double(SNR); // %li.
-      writer.String("size");
-      writer.Uint(length);
-      writer.String("data");
-      writer.String(b64);
-      writer.EndObject();
-      writer.EndArray();
-      writer.EndObject();
-
-      string json = sb.GetString();
-      printf(json.c_str());
-      fflush(stdout);
-
-      // Build and send message.
-      memcpy(buff_up + 12, json.c_str(), json.size());
-      SendUdp(buff_up, buff_index + json.size());
-
-      fflush(stdout);
-    }
-  }
-  return ret;
+// rxpk text that only depends on the configuration, built by RxpkInit()
+// once the gateway ID is known so that ForwardPacket() only fills in the
+// per frame values.
+static RxpkChan_t rxpk_chans[RADIO_MAX * HOP_MAX_CHANNELS];
+static uint8_t rxpk_head[12];       /* PUSH_DATA header, token set per datagram */
+static Datagram_t* batch;           /* upstream record being filled */
+static Datagram_t batch_spill;      /* stands in for it when the ring is full */
+static char* buff_up;               /* batch->data */
+static int batch_len;               /* bytes used in buff_up */
+static int batch_nb;                /* rxpk objects in it */
+static uint64_t batch_due_ns;       /* flush deadline of the first one */
+
+void RxpkInit()
+{
+  rxpk_head[0] = PROTOCOL_VERSION;
+  rxpk_head[3] = PKT_PUSH_DATA;
+  rxpk_head[4] = (uint8_t)ifr.ifr_hwaddr.sa_data[0];
+  rxpk_head[5] = (uint8_t)ifr.ifr_hwaddr.sa_data[1];
+  rxpk_head[6] = (uint8_t)ifr.ifr_hwaddr.sa_data[2];
+  rxpk_head[7] = 0xFF;
+  rxpk_head[8] = 0xFF;
+  rxpk_head[9] = (uint8_t)ifr.ifr_hwaddr.sa_data[3];
+  rxpk_head[10] = (uint8_t)ifr.ifr_hwaddr.sa_data[4];
+  rxpk_head[11] = (uint8_t)ifr.ifr_hwaddr.sa_data[5];
+
+  for (int i = 0; i < radio_nb; i++) {
+    Radio_t* r = &radios[i];
+    int nb = r->hop_nb > 0 ? r->hop_nb : 1;
+    for (int j = 0; j < nb; j++) {
+      uint32_t freq = r->hop_nb > 0 ? r->hop_channels[j].freq : r->freq;
+      RxpkChanInit(&rxpk_chans[r->chan_base + j], freq, r->chan_base + j, r->id);
+    }
+  }
 }
 
-char data_received[1024];        
-struct sockaddr from;
-socklen_t addrlen = sizeof(from);
+// Runs on the main thread only, so the cp_* and rx_lat_* counters and stdout
+// need no locking.
+void ForwardPacket(const RxPacket_t* p_pkt)
+{
+  cp_nb_rx_rcv++;
+  if (!p_pkt->crc_ok) {
+    printf("CRC error\n");
+    return;
+  }
+  cp_nb_rx_ok++;
+  cp_nb_rx_ok_tot++;
+  printf( "Rx data size %d\r\n", p_pkt->length);
 
-int main()
+  uint64_t start_ns = MonotonicNs();
+
+  if (p_pkt->irq_err_us > 0) {
+    // caught up without an edge, its RxDone time is an estimate
+    rx_est_nb++;
+    if (p_pkt->irq_err_us > rx_est_err_max) {
+      rx_est_err_max = p_pkt->irq_err_us;
+    }
+  } else {
+    uint32_t lat = (uint32_t)((p_pkt->drained_ns - p_pkt->irq_ns) / 1000);
+    if (rx_lat_nb == 0 || lat < rx_lat_min) {
+      rx_lat_min = lat;
+    }
+    if (lat > rx_lat_max) {
+      rx_lat_max = lat;
+    }
+    rx_lat_sum += lat;
+    rx_lat_nb++;
+    int bucket = 0;
+    while (bucket < RX_LAT_HIST_SIZE - 1 && lat >= rx_lat_hist_us[bucket]) {
+      bucket++;
+    }
+    rx_lat_hist[bucket]++;
+  }
+
+  // Make room, a datagram always takes at least one frame
+  int max_len = RXPK_MAX_FIXED + 4 * ((p_pkt->length + 2) / 3);
+  if (batch_nb > 0 && batch_len + 1 + max_len + 2 > (int)batch_bytes) {
+    BatchFlush();
+  }
+
+  // JSON straight after the 12-byte header, same text as rapidjson's Writer
+  char* p;
+  if (batch_nb == 0) {
+    // a full ring loses the datagram, not the stdout line
+    batch = upstream.Claim();
+    if (batch == NULL) {
+      batch = &batch_spill;
+    }
+    buff_up = batch->data;
+    memcpy(buff_up, rxpk_head, sizeof(rxpk_head));
+    p = RxpkPutStr(buff_up + sizeof(rxpk_head), "{\"rxpk\":[");
+    batch_due_ns = start_ns + (uint64_t)batch_ms * 1000000;
+  } else {
+    p = buff_up + batch_len;
+    *p++ = ',';
+  }
+  char* obj = p;
+  p = RxpkPut(p, p_pkt, &rxpk_chans[p_pkt->chan]);
+  if (p == NULL) {
+    // the batch is left as it was, an unpublished ring record is free again
+    rxpk_drop++;
+    printf("rxpk: cannot encode the payload, frame dropped\n");
+    fflush(stdout);
+    return;
+  }
+  batch_len = p - buff_up;
+  batch_nb++;
+
+  rxpk_ns_sum += MonotonicNs() - start_ns;
+  rxpk_ns_nb++;
+
+  // one frame per line whatever the batching
+  printf("incoming packet...\n");
+  printf("{\"rxpk\":[%.*s]}\n", (int)(p - obj), obj);
+  fflush(stdout);
+
+  if (batch_ms == 0) {
+    BatchFlush();
+  }
+}
+
+// Close and send the pending PUSH_DATA, if any
+void BatchFlush()
 {
-  struct timeval nowtime;
-  uint32_t lasttime;
+  if (batch_nb == 0) {
+    return;
+  }
+  char* p = RxpkPutStr(buff_up + batch_len, "]}");
+  buff_up[1] = (uint8_t)rand(); /* random token */
+  buff_up[2] = (uint8_t)rand(); /* random token */
+  batch->len = p - buff_up;
+  if (batch == &batch_spill) {
+    // never sent, out of the histogram
+    batch_spill_rxpk += batch_nb;
+  } else {
+    upstream.Publish();
+    int bucket = 0;
+    while (bucket < BATCH_HIST_SIZE - 1 && batch_nb > (1 << bucket)) {
+      bucket++;
+    }
+    batch_hist[bucket]++;
+  }
+  batch_nb = 0;
+  batch_len = 0;
+}
 
-  LoadConfiguration("global_conf.json");
-  PrintConfiguration();
+// ms until the pending PUSH_DATA is due, -1 if there is none
+int BatchWaitMs()
+{
+  if (batch_nb == 0) {
+    return -1;
+  }
+  uint64_t now = MonotonicNs();
+  return now >= batch_due_ns ? 0 : (int)((batch_due_ns - now + 999999) / 1000000);
+}
+
+// First line of a /proc or /sys file, empty if it cannot be read
+static string ReadLine(const char* path)
+{
+  char line[256] = "";
+  FILE* f = fopen(path, "r");
+  if (f != NULL) {
+    if (fgets(line, sizeof(line), f) == NULL) {
+      line[0] = '\0';
+    }
+    fclose(f);
+  }
+  line[strcspn(line, "\n")] = '\0';
+  return line;
+}
 
-  // Init WiringPI
-  wiringPiSetup() ;
-  pinMode(nssPin, OUTPUT);
-  pinMode(dio0, INPUT);
-  pinMode(rstPin, OUTPUT);
+// Value of a /proc/self/status field such as "VmLck", empty if not there
+static string ProcStatus(const char* field)
+{
+  char line[256];
+  string value;
+  size_t len = strlen(field);
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f == NULL) {
+    return value;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, field, len) == 0 && line[len] == ':') {
+      value = line + len + 1 + strspn(line + len + 1, " \t");
+      value.erase(value.find_last_not_of(" \n") + 1);
+      break;
+    }
+  }
+  fclose(f);
+  return value;
+}
 
-  // Init SPI
-  wiringPiSPISetup(SPI_CHANNEL, 500000);
+// Whether cpu is in a kernel CPU list such as "2-3,6"
+static bool CpuListHas(const string& list, int cpu)
+{
+  const char* p = list.c_str();
+  while (*p != '\0') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p) {
+      return false;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+    }
+    if (cpu >= first && cpu <= last) {
+      return true;
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return false;
+}
 
-  // Setup LORA
-  SetupLoRa();
+// Locked memory the threads and the heap may still need once mlockall() is
+// in place: the stacks of the stage, DNS, network, radio and emulator
+// threads, and room for heap growth and the resolver libraries
+#define RT_MEMLOCK_HEADROOM (4 * 1024 * 1024)
+#define CAP_IPC_LOCK_BIT    14
+
+// Real-time mode, on when a radio has an rt_priority: the whole process is
+// locked in memory before the threads start, which also faults in the
+// rings and buffers, and the kernel settings that would still let a radio
+// thread wait are reported. The threads themselves are set up by
+// RadioStart(). Memory is left unlocked rather than have a thread fail to
+// start on RLIMIT_MEMLOCK later.
+void RealtimeSetup()
+{
+  bool rt = false;
+  for (int i = 0; i < radio_nb; i++) {
+    rt = rt || radios[i].rt_priority > 0;
+  }
+  if (!rt) {
+    return;
+  }
 
-  // Prepare Socket connection
-  if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-    Die("socket");
+  // freed memory stays mapped and locked, no mmap() per allocation, and no
+  // 64 MiB arena reservation per thread
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  mallopt(M_ARENA_MAX, 1);
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    printf("Real-time: mlockall failed (%s), raise RLIMIT_MEMLOCK or grant CAP_IPC_LOCK\n", strerror(errno));
+  } else {
+    // CAP_IPC_LOCK lifts the limit
+    struct rlimit lim;
+    uint64_t caps = strtoull(ProcStatus("CapEff").c_str(), NULL, 16);
+    uint64_t locked = strtoull(ProcStatus("VmLck").c_str(), NULL, 10) * 1024;
+    uint64_t need = locked + (uint64_t)(2 * radio_nb + 4) * HAL_THREAD_STACK + RT_MEMLOCK_HEADROOM;
+    if ((caps & (1ULL << CAP_IPC_LOCK_BIT)) == 0 && getrlimit(RLIMIT_MEMLOCK, &lim) == 0 &&
+        lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur < need) {
+      munlockall();
+      printf("Real-time: memory not locked, needs about %llu KiB, RLIMIT_MEMLOCK is %llu KiB\n",
+             (unsigned long long)(need / 1024), (unsigned long long)(lim.rlim_cur / 1024));
+    }
   }
-  struct timeval read_timeout;
-  read_timeout.tv_sec = 0;
-  read_timeout.tv_usec = 10;
-  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &read_timeout, sizeof read_timeout);
 
-  memset((char *) &si_other, 0, sizeof(si_other));
-  si_other.sin_family = AF_INET;
+  if (access("/sys/kernel/realtime", F_OK) != 0) {
+    printf("Real-time: not a PREEMPT_RT kernel, wake ups can still take ms\n");
+  }
+  string runtime = ReadLine("/proc/sys/kernel/sched_rt_runtime_us");
+  if (!runtime.empty() && runtime != "-1") {
+    printf("Real-time: RT throttling on (sched_rt_runtime_us %s)\n", runtime.c_str());
+  }
+  string isolated = ReadLine("/sys/devices/system/cpu/isolated");
+  for (int i = 0; i < radio_nb; i++) {
+    Radio_t* r = &radios[i];
+    if (r->rt_cpu >= 0 && !CpuListHas(isolated, r->rt_cpu)) {
+      printf("Real-time: CPU %d of radio %d is not isolated (isolcpus=), other tasks share it\n", r->rt_cpu, r->id);
+    }
+  }
+  fflush(stdout);
+}
+
+// Startup stages
+
+bool StageRadio(void* arg)
+{
+  return RadioSetup((Radio_t*)arg);
+}
 
+bool StageSocket(void* arg)
+{
+  // Prepare Socket connection
+  if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    perror("socket");
+    return false;
+  }
   ifr.ifr_addr.sa_family = AF_INET;
   strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
   ioctl(s, SIOCGIFHWADDR, &ifr);
+  return true;
+}
+
+void* StageThread(void* arg)
+{
+  Stage_t* stage = (Stage_t*)arg;
+  uint64_t start = MonotonicNs();
+  stage->ok = stage->run(stage->arg);
+  stage->elapsed_ns = MonotonicNs() - start;
+  return NULL;
+}
+
+// Run all stages concurrently and wait for them, then log their timings.
+// Returns the first required stage that failed, NULL if none did.
+const Stage_t* RunStages(Stage_t* stages, int count)
+{
+  const Stage_t* failed = NULL;
+  uint64_t start = MonotonicNs();
+
+  for (int i = 0; i < count; i++) {
+    if (HalThreadCreate(&stages[i].thread, StageThread, &stages[i]) != 0) {
+      Die("pthread_create");
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    pthread_join(stages[i].thread, NULL);
+  }
+
+  printf("Startup:");
+  for (int i = 0; i < count; i++) {
+    printf(" %s %.1f ms%s,", stages[i].name, stages[i].elapsed_ns / 1e6, stages[i].ok ? "" : " (failed)");
+    if (!stages[i].ok && stages[i].required && failed == NULL) {
+      failed = &stages[i];
+    }
+  }
+  printf(" ready in %.1f ms\n", (MonotonicNs() - start) / 1e6);
+  return failed;
+}
+
+char data_received[1024];        
+struct sockaddr from;
+socklen_t addrlen = sizeof(from);
+
+int main()
+{
+  // Signals are read from a signalfd by the main loop. Blocked before any
+  // thread exists, backends start some during setup, so all inherit it.
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  LoadConfiguration("global_conf.json");
+  PrintConfiguration();
+
+  printf("Using %s hardware backend\n", hal->name);
+  if (radio_nb == 0) {
+    printf("No radio in SX127x_conf\n");
+    exit(EXIT_FAILURE);
+  }
+  RealtimeSetup();
+
+  // Servers are first looked up by DnsThread() too, datagrams for the ones
+  // not resolved yet are counted as not sent. A slow resolver never holds
+  // the radios up.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&dns_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_t dns_thread;
+  if (HalThreadCreate(&dns_thread, DnsThread, NULL) != 0) {
+    Die("pthread_create");
+  }
+
+  // Radio reset and detection and the socket do not depend on each other
+  Stage_t stages[RADIO_MAX + 1];
+  int stage_nb = 0;
+  memset(stages, 0, sizeof(stages));
+  for (int i = 0; i < radio_nb; i++) {
+    snprintf(stages[stage_nb].name, sizeof(stages[0].name), "radio %d", i);
+    stages[stage_nb].run = StageRadio;
+    stages[stage_nb].required = true;
+    stages[stage_nb++].arg = &radios[i];
+  }
+  strcpy(stages[stage_nb].name, "socket");
+  stages[stage_nb].required = true;
+  stages[stage_nb++].run = StageSocket;
+
+  const Stage_t* failed = RunStages(stages, stage_nb);
+  if (failed != NULL) {
+    Die(failed->name);
+  }
 
   // ID based on MAC Adddress of eth0
   if(strlen(eui) > 0) {
@@ -663,39 +1147,214 @@ int main()
               (uint8_t)ifr.ifr_hwaddr.sa_data[3],
               (uint8_t)ifr.ifr_hwaddr.sa_data[4],
               (uint8_t)ifr.ifr_hwaddr.sa_data[5]);  
-  printf("Listening at SF%i, BW %d on %.6lf Mhz.\n", sf, bw, (double)freq/1000000);        
+  for (int i = 0; i < radio_nb; i++) {
+    Radio_t* r = &radios[i];
+    printf("Radio %d listening at SF%i, BW %d, CR %s on %.6lf Mhz.\n", r->id, r->sf, r->bw, r->modem_conf->codr, (double)r->freq/1000000);
+  }
   printf("-----------------------------------\n");
+  fflush(stdout);
+  RxpkInit();
+
+  // One receive thread per radio, the main thread encodes, NetThread() sends
+  int net_fd = RingEventFd();
+  if (net_fd < 0) {
+    Die("eventfd");
+  }
+  upstream.Init(net_fd);
+  pthread_t net_thread;
+  if (HalThreadCreate(&net_thread, NetThread, NULL) != 0) {
+    Die("pthread_create");
+  }
+  UplinkInit();
+  for (int i = 0; i < radio_nb; i++) {
+    if (!RadioStart(&radios[i], UplinkPush)) {
+      Die("pthread_create");
+    }
+  }
+
+  // Status report right away, then every STAT_INTERVAL
+  int stat_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec stat_period;
+  stat_period.it_value.tv_sec = 0;
+  stat_period.it_value.tv_nsec = 1;
+  stat_period.it_interval.tv_sec = STAT_INTERVAL;
+  stat_period.it_interval.tv_nsec = 0;
+  int sig_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (stat_fd < 0 || sig_fd < 0 || timerfd_settime(stat_fd, 0, &stat_period, NULL) < 0) {
+    Die("timerfd / signalfd");
+  }
+
+  // The main thread sleeps in epoll_wait() until a frame is queued, a
+  // report is due, a signal arrives or the pending PUSH_DATA batch has to go
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  int fds[] = { uplink[0].efd, stat_fd, sig_fd };
+  for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+      Die("epoll");
+    }
+  }
 
   while(1) {
-    // rx packet
-    Receivepacket();
-    fflush(stdout);
-    // timestamp packet
-    gettimeofday(&nowtime, NULL);
-    fflush(stdout);
-    uint32_t nowseconds = (uint32_t)(nowtime.tv_sec);
-    if (nowseconds - lasttime >= 5) {
-      lasttime = nowseconds;
-      SendStat();
-      fflush(stdout);
-      cp_nb_rx_rcv = 0;
-      cp_nb_rx_ok = 0;
-      cp_up_pkt_fwd = 0;
-    }
-    // Let some time to the OS
-    delay(1);
-    //int  bytes_received = recvfrom(s, data_received, sizeof(data_received), 0, &from, &addrlen);
-    //if(bytes_received>0) {
-    //    printf("\nReceive from server %d\n", bytes_received);
-    //    for(int i=0;i<addrlen;i++) {
-    //        printf("%c", data_received[i]);
-    //    }
-    //    printf("<<--End<<--\n\n");
-    //}
+    struct epoll_event events[3];
+    int nb = epoll_wait(epoll_fd, events, 3, BatchWaitMs());
+    if (nb < 0 && errno != EINTR) {
+      Die("epoll_wait");
+    }
+
+    for (int i = 0; i < nb; i++) {
+      int fd = events[i].data.fd;
+      uint64_t count;
+
+      if (fd == uplink[0].efd) {
+        if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+          // frames are encoded straight from the ring records
+          for (int j = 0; j < radio_nb; j++) {
+            RxPacket_t* p_pkt;
+            while ((p_pkt = uplink[j].Front()) != NULL) {
+              ForwardPacket(p_pkt);
+              uplink[j].Release();
+            }
+          }
+        }
+      } else if (fd == stat_fd) {
+        if (read(stat_fd, &count, sizeof(count)) == sizeof(count)) {
+          SendStat();
+          cp_nb_rx_rcv = 0;
+          cp_nb_rx_ok = 0;
+          cp_up_pkt_fwd = 0;
+          rx_lat_nb = 0;
+          rx_lat_min = 0;
+          rx_lat_max = 0;
+          rx_lat_sum = 0;
+          rxpk_ns_nb = 0;
+          rxpk_ns_sum = 0;
+        }
+      } else if (fd == sig_fd) {
+        struct signalfd_siginfo si;
+        if (read(sig_fd, &si, sizeof(si)) != sizeof(si)) {
+          continue;
+        }
+        if (si.ssi_signo == SIGHUP) {
+          // the radios keep their setup, a new one needs a restart
+          fprintf(stderr, "SIGHUP: looking servers up again\n");
+          DnsRefresh();
+        } else {
+          // do not lose the frames waiting for the batch deadline
+          // and give NetThread() up to a second to send what is queued
+          BatchFlush();
+          for (int j = 0; j < 100 && upstream.Depth() > 0; j++) {
+            usleep(10000);
+          }
+          fprintf(stderr, "Exiting on signal %u\n", si.ssi_signo);
+          fflush(stdout);
+          exit(EXIT_SUCCESS);
+        }
+      }
+    }
+
+    if (BatchWaitMs() == 0) {
+      BatchFlush();
+    }
   }
   return (0);
 }
 
+// One radio object of SX127x_conf
+void LoadRadioConfiguration(const Value& sx127x_conf, Radio_t* r)
+{
+  for (Value::ConstMemberIterator confIt = sx127x_conf.MemberBegin(); confIt != sx127x_conf.MemberEnd(); ++confIt) {
+    string key(confIt->name.GetString());
+    if (key.compare("freq") == 0) {
+      r->freq = confIt->value.GetUint();
+    } else if (key.compare("spread_factor") == 0) {
+      r->sf = (SpreadingFactor_t)confIt->value.GetUint();
+    } else if (key.compare("bandwidth") == 0 && confIt->value.IsUint()) {
+      r->bw = confIt->value.GetUint() / 1000;    // in Hz like freq
+    } else if (key.compare("coding_rate") == 0 && confIt->value.IsString()) {
+      // "4/5" .. "4/8"
+      const char* str = confIt->value.GetString();
+      r->cr = (strlen(str) == 3 && str[0] == '4' && str[1] == '/') ? str[2] - '0' : 0;
+    } else if (key.compare("spi_channel") == 0 && confIt->value.IsUint()) {
+      r->spi_channel = confIt->value.GetUint();
+    } else if (key.compare("spi_speed") == 0 && confIt->value.IsUint()) {
+      // in Hz, or "auto" to find the fastest clock that works
+      r->spi_speed = confIt->value.GetUint();
+      r->spi_calibrate = false;
+    } else if (key.compare("spi_speed") == 0 && confIt->value.IsString()) {
+      r->spi_calibrate = strcmp(confIt->value.GetString(), "auto") == 0;
+      r->spi_speed = r->spi_calibrate ? SPI_SPEED_MAX : SPI_SPEED_DEFAULT;
+    } else if (key.compare("pin_nss") == 0) {
+      r->nss = confIt->value.GetUint();
+    } else if (key.compare("pin_dio0") == 0) {
+      r->dio0 = confIt->value.GetUint();
+    } else if (key.compare("pin_rst") == 0) {
+      r->rst = confIt->value.GetUint();
+    } else if (key.compare("pin_dio3") == 0) {
+      r->dio3 = confIt->value.GetUint();
+    } else if (key.compare("channels") == 0 && confIt->value.IsArray()) {
+      // e.g. the 8 EU868 uplink channels, in Hz like freq
+      r->hop_nb = 0;
+      for (SizeType i = 0; i < confIt->value.Size() && r->hop_nb < HOP_MAX_CHANNELS; i++) {
+        memset(&r->hop_channels[r->hop_nb], 0, sizeof(HopChannel_t));
+        r->hop_channels[r->hop_nb++].freq = confIt->value[i].GetUint();
+      }
+    } else if (key.compare("dwell_ms") == 0 && confIt->value.IsUint()) {
+      r->hop_dwell_ms = confIt->value.GetUint();
+    } else if (key.compare("cad_sf") == 0 && confIt->value.IsArray()) {
+      // e.g. [7, 8, 9, 10, 11, 12]
+      r->cad_nb = 0;
+      for (SizeType i = 0; i < confIt->value.Size() && r->cad_nb < CAD_MAX_SF; i++) {
+        const Value& sf = confIt->value[i];
+        if (!sf.IsUint() || sf.GetUint() < SF7 || sf.GetUint() > SF12) {
+          printf("cad_sf: spreading factors are 7 to 12\n");
+          exit(EXIT_FAILURE);
+        }
+        memset(&r->cad_slots[r->cad_nb], 0, sizeof(CadSlot_t));
+        r->cad_slots[r->cad_nb++].sf = (SpreadingFactor_t)sf.GetUint();
+      }
+    } else if (key.compare("stream_rx") == 0 && confIt->value.IsBool()) {
+      r->stream_rx = confIt->value.GetBool();
+    } else if (key.compare("rt_priority") == 0 && confIt->value.IsUint()) {
+      // SCHED_FIFO 1 .. 99, 0 leaves the thread a normal one
+      r->rt_priority = confIt->value.GetUint() > 99 ? 99 : confIt->value.GetUint();
+    } else if (key.compare("rt_cpu") == 0 && confIt->value.IsUint()) {
+      r->rt_cpu = confIt->value.GetUint();
+    } else if (key.compare("hal") == 0 && confIt->value.IsString()) {
+      hal = HalFind(confIt->value.GetString());
+      if (hal == NULL) {
+        printf("Hardware backend \"%s\" not built in\n", confIt->value.GetString());
+        exit(EXIT_FAILURE);
+      }
+    } else if (key.compare("emulator_script") == 0 && confIt->value.IsString()) {
+      if (!EmuLoadScript(confIt->value.GetString())) {
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // HopCheck() and the CAD rotation would both retune the radio
+  if (r->cad_nb > 0 && (r->hop_nb > 0 || sx127x_conf.HasMember("dwell_ms"))) {
+    printf("cad_sf: not with channels or dwell_ms, a radio either hops or runs CAD\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Runtime state of a server read from the configuration: not looked up
+// yet, no counts
+void ServerInit(Server_t* p_server)
+{
+  p_server->resolved = false;
+  p_server->dns_fail = 0;
+  p_server->dns_due_ns = 0;
+  p_server->dns_drop = 0;
+  p_server->send_fail = 0;
+  p_server->send_errno = 0;
+  memset(&p_server->ack, 0, sizeof(p_server->ack));
+}
+
 void LoadConfiguration(string configurationFile)
 {
   FILE* p_file = fopen(configurationFile.c_str(), "r");
@@ -710,22 +1369,27 @@ void LoadConfiguration(string configurationFile)
     if (objectType.compare("SX127x_conf") == 0) {
       const Value& sx127x_conf = fileIt->value;
       if (sx127x_conf.IsObject()) {
-        for (Value::ConstMemberIterator confIt = sx127x_conf.MemberBegin(); confIt != sx127x_conf.MemberEnd(); ++confIt) {
-          string key(confIt->name.GetString());
-          if (key.compare("freq") == 0) {
-            freq = confIt->value.GetUint();
-          } else if (key.compare("spread_factor") == 0) {
-            sf = (SpreadingFactor_t)confIt->value.GetUint();
-          } else if (key.compare("pin_nss") == 0) {
-            nssPin = confIt->value.GetUint();
-          } else if (key.compare("pin_dio0") == 0) {
-            dio0 = confIt->value.GetUint();
-          } else if (key.compare("pin_rst") == 0) {
-            rstPin = confIt->value.GetUint();
+        RadioInit(&radios[0], 0);
+        LoadRadioConfiguration(sx127x_conf, &radios[0]);
+        radio_nb = 1;
+      } else if (sx127x_conf.IsArray()) {
+        radio_nb = 0;
+        for (SizeType i = 0; i < sx127x_conf.Size() && radio_nb < RADIO_MAX; i++) {
+          if (sx127x_conf[i].IsObject()) {
+            RadioInit(&radios[radio_nb], radio_nb);
+            LoadRadioConfiguration(sx127x_conf[i], &radios[radio_nb]);
+            radio_nb++;
           }
         }
       }
 
+      // rxpk "chan" numbers run on across radios, one per hopping channel
+      int chan = 0;
+      for (int i = 0; i < radio_nb; i++) {
+        radios[i].chan_base = chan;
+        chan += radios[i].hop_nb > 0 ? radios[i].hop_nb : 1;
+      }
+
     } else if (objectType.compare("gateway_conf") == 0) {
       const Value& gateway_conf = fileIt->value;
       if (gateway_conf.IsObject()) {
@@ -752,11 +1416,19 @@ void LoadConfiguration(string configurationFile)
           } else if (memberType.compare("desc") == 0 && confIt->value.IsString()) {
             string str = confIt->value.GetString();
             strcpy(description, str.length()<=64 ? str.c_str() : "description is too long");
+          } else if (memberType.compare("dns_refresh_s") == 0 && confIt->value.IsUint()) {
+            dns_refresh_s = confIt->value.GetUint() > DNS_RETRY_S ? confIt->value.GetUint() : DNS_RETRY_S;
+          } else if (memberType.compare("batch_ms") == 0 && confIt->value.IsUint()) {
+            batch_ms = confIt->value.GetUint();
+          } else if (memberType.compare("batch_bytes") == 0 && confIt->value.IsUint()) {
+            // a full datagram must still fit in buff_up
+            batch_bytes = confIt->value.GetUint() < TX_BUFF_SIZE ? confIt->value.GetUint() : TX_BUFF_SIZE;
           } else if (memberType.compare("servers") == 0) {
             const Value& serverConf = confIt->value;
             if (serverConf.IsObject()) {
               const Value& serverValue = serverConf;
               Server_t server;
+              ServerInit(&server);
               for (Value::ConstMemberIterator srvIt = serverValue.MemberBegin(); srvIt != serverValue.MemberEnd(); ++srvIt) {
                 string key(srvIt->name.GetString());
                 if (key.compare("address") == 0 && srvIt->value.IsString()) {
@@ -773,6 +1445,7 @@ void LoadConfiguration(string configurationFile)
               for (SizeType i = 0; i < serverConf.Size(); i++) {
                 const Value& serverValue = serverConf[i];
                 Server_t server;
+                ServerInit(&server);
                 for (Value::ConstMemberIterator srvIt = serverValue.MemberBegin(); srvIt != serverValue.MemberEnd(); ++srvIt) {
                   string key(srvIt->name.GetString());
                   if (key.compare("address") == 0 && srvIt->value.IsString()) {
@@ -802,4 +1475,17 @@ void PrintConfiguration()
   printf("  %s (%s)\n  %s\n", platform, email, description);
   printf("  Latitude=%.8f\n  Longitude=%.8f\n  Altitude=%d\n", lat,lon,alt);
   printf("  Interface %s\n", if_name);
+  printf("  %d radio%s\n", radio_nb, radio_nb > 1 ? "s" : "");
+  for (int i = 0; i < radio_nb; i++) {
+    if (radios[i].rt_priority > 0) {
+      printf("  Radio %d real-time: SCHED_FIFO %d", i, radios[i].rt_priority);
+      if (radios[i].rt_cpu >= 0) {
+        printf(", CPU %d", radios[i].rt_cpu);
+      }
+      printf("\n");
+    }
+  }
+  if (batch_ms > 0) {
+    printf("  PUSH_DATA batching: %u ms, %u bytes\n", batch_ms, batch_bytes);
+  }
 }
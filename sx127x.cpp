@@ -0,0 +1,1136 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+#include "sx127x.h"
+
+#include <poll.h>
+#include <sched.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#define REG_FIFO                    0x00
+#define REG_FIFO_ADDR_PTR           0x0D
+#define REG_FIFO_TX_BASE_AD         0x0E
+#define REG_FIFO_RX_BASE_AD         0x0F
+#define REG_RX_NB_BYTES             0x13
+#define REG_OPMODE                  0x01
+#define REG_FIFO_RX_CURRENT_ADDR    0x10
+#define REG_IRQ_FLAGS               0x12
+#define REG_DIO_MAPPING_1           0x40
+#define REG_DIO_MAPPING_2           0x41
+
+// DIO MAPPING 1, DIO0 in bits 7-6, DIO3 in bits 1-0
+#define MAP_DIO0_LORA_RXDONE        0x00
+#define MAP_DIO0_LORA_CADDONE       0x80
+#define MAP_DIO3_LORA_VALIDHEADER   0x01
+#define REG_MODEM_CONFIG            0x1D
+#define REG_MODEM_CONFIG2           0x1E
+#define REG_MODEM_CONFIG3           0x26
+#define REG_SYMB_TIMEOUT_LSB        0x1F
+#define REG_MODEM_STAT              0x18
+#define REG_PKT_SNR_VALUE           0x19
+#define REG_PKT_RSSI_VALUE          0x1A
+#define REG_RSSI_VALUE              0x1B
+#define REG_PAYLOAD_LENGTH          0x22
+#define REG_IRQ_FLAGS_MASK          0x11
+#define REG_MAX_PAYLOAD_LENGTH      0x23
+#define REG_HOP_PERIOD              0x24
+#define REG_FIFO_RX_BYTE_ADDR       0x25
+#define REG_FEI_MSB                 0x28
+#define REG_FEI_LSB                 0x2A
+#define REG_SYNC_WORD               0x39
+#define REG_VERSION                 0x42
+
+// MODEM STAT
+#define MODEM_STAT_SIGNAL_DETECTED  0x01
+#define MODEM_STAT_SIGNAL_SYNC      0x02
+
+// IRQ FLAGS
+#define IRQ_RX_DONE                 0x40
+#define IRQ_PAYLOAD_CRC_ERROR       0x20
+#define IRQ_VALID_HEADER            0x10
+#define IRQ_RX_TIMEOUT              0x80
+#define IRQ_CAD_DONE                0x04
+#define IRQ_CAD_DETECTED            0x01
+
+// RX metadata block: REG_FIFO_RX_CURRENT_ADDR .. REG_RSSI_VALUE are
+// contiguous, so a single burst read returns everything ReceivePkt needs.
+#define RX_META_BASE                REG_FIFO_RX_CURRENT_ADDR
+#define RX_META_LEN                 (REG_RSSI_VALUE - REG_FIFO_RX_CURRENT_ADDR + 1)
+#define RX_META(reg)                ((reg) - RX_META_BASE)
+
+#define SX72_MODE_RX_CONTINUOS      0x85
+#define SX72_MODE_TX                0x83
+#define SX72_MODE_SLEEP             0x80
+#define SX72_MODE_STANDBY           0x81
+#define SX72_MODE_RX_SINGLE         0x86
+#define SX72_MODE_CAD               0x87
+#define OPMODE_LONG_RANGE           0x80  // LoRa, only changes in sleep
+
+
+#define PAYLOAD_LENGTH              0x40
+
+// LOW NOISE AMPLIFIER
+#define REG_LNA                     0x0C
+#define LNA_MAX_GAIN                0x23
+#define LNA_OFF_GAIN                0x00
+#define LNA_LOW_GAIN                0x20
+
+// FRF
+#define REG_FRF_MSB              0x06
+#define REG_FRF_MID              0x07
+#define REG_FRF_LSB              0x08
+
+#define CAD_PREAMBLE_SYMBOLS  8  // LoRaWAN preamble
+#define CAD_SYMBOLS           2  // a CAD takes about two symbols
+
+// Datasheet minimums: reset held >= 100 us, then 5 ms before the chip
+// answers on SPI
+#define RESET_PULSE_MS     1
+#define RESET_READY_MS     5
+#define LORA_MODE_TRIES    10    // 1 ms apart, for the switch to LoRa sleep
+
+// SPI clock calibration
+#define SPI_CAL_ROUNDS     32    // pattern checks per candidate clock
+#define SPI_CAL_BURST      64    // FIFO bytes per burst check
+
+#define STREAM_CHUNK       16    // bytes on air between two streaming drains
+#define STREAM_TIMEOUT_MS  5000  // give up on a header never followed by RxDone
+
+uint64_t MonotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint8_t ReadRegister(Radio_t* r, uint8_t addr)
+{
+  uint8_t spibuf[2];
+  spibuf[0] = addr & 0x7F;
+  spibuf[1] = 0x00;
+
+  SpiXfer_t xfer = { spibuf, spibuf, 2 };
+  hal->spi_transfer(r->bus, &xfer, 1);
+
+  return spibuf[1];
+}
+
+void WriteRegister(Radio_t* r, uint8_t addr, uint8_t value)
+{
+  uint8_t spibuf[2];
+  spibuf[0] = addr | 0x80;
+  spibuf[1] = value;
+
+  SpiXfer_t xfer = { spibuf, NULL, 2 };
+  hal->spi_transfer(r->bus, &xfer, 1);
+}
+
+// Burst read of len consecutive registers starting at addr. On REG_FIFO the
+// address does not auto-increment, so this drains len bytes from the FIFO.
+static void ReadRegisters(Radio_t* r, uint8_t addr, uint8_t* buf, int len)
+{
+  uint8_t spibuf[HAL_SPI_MAX_LEN];
+  spibuf[0] = addr & 0x7F;
+  memset(spibuf + 1, 0x00, len);
+
+  SpiXfer_t xfer = { spibuf, spibuf, (uint16_t)(len + 1) };
+  hal->spi_transfer(r->bus, &xfer, 1);
+
+  memcpy(buf, spibuf + 1, len);
+}
+
+// Burst write of len consecutive registers starting at addr
+static void WriteRegisters(Radio_t* r, uint8_t addr, const uint8_t* buf, int len)
+{
+  uint8_t spibuf[HAL_SPI_MAX_LEN];
+  spibuf[0] = addr | 0x80;
+  memcpy(spibuf + 1, buf, len);
+
+  SpiXfer_t xfer = { spibuf, NULL, (uint16_t)(len + 1) };
+  hal->spi_transfer(r->bus, &xfer, 1);
+}
+
+// Count one event under the stats lock
+static void StatCount(Radio_t* r, uint32_t* p_counter)
+{
+  pthread_mutex_lock(&r->lock);
+  (*p_counter)++;
+  pthread_mutex_unlock(&r->lock);
+}
+
+// In continuous RX the modem writes frame after frame around the 256 byte
+// FIFO, each one starting where the previous ended; the 8 bit FIFO address
+// wraps by itself. A frame not starting at fifo_next means the FIFO moved
+// past one we never saw an RxDone for.
+static void FifoTrack(Radio_t* r, uint8_t start, uint8_t length)
+{
+  if (r->fifo_valid && start != r->fifo_next) {
+    StatCount(r, &r->rx_overrun);
+  }
+  r->fifo_next = start + length;
+  r->fifo_valid = true;
+}
+
+// Read out the frame behind RxDone into p_pkt. Returns false on a CRC
+// error, the flags are cleared and the payload left in the FIFO then.
+// Sets rx_pending when the next frame completed while this one was read,
+// its RxDone went with the flags cleared here.
+static bool ReceivePkt(Radio_t* r, RxPacket_t* p_pkt)
+{
+  uint8_t meta[RX_META_LEN];
+  RxStream_t* st = &r->rx_stream;
+
+  // current address, irq flags, byte count, SNR and RSSI in one transaction
+  r->pending_from_ns = MonotonicNs();
+  ReadRegisters(r, RX_META_BASE, meta, RX_META_LEN);
+
+  uint8_t irqflags = meta[RX_META(REG_IRQ_FLAGS)];
+  uint8_t currentAddr = meta[RX_META(REG_FIFO_RX_CURRENT_ADDR)];
+  uint8_t receivedCount = meta[RX_META(REG_RX_NB_BYTES)];
+  p_pkt->meta.irqflags = irqflags;
+  p_pkt->meta.snr      = meta[RX_META(REG_PKT_SNR_VALUE)];
+  p_pkt->meta.pkt_rssi = meta[RX_META(REG_PKT_RSSI_VALUE)];
+  p_pkt->meta.rssi     = meta[RX_META(REG_RSSI_VALUE)];
+  p_pkt->length = 0;
+  FifoTrack(r, currentAddr, receivedCount);
+
+  // clear irq and read the current address back, so a frame completing
+  // in between is noticed
+  uint8_t clear_irq[2] = { REG_IRQ_FLAGS | 0x80, 0 };
+  uint8_t check[2] = { REG_FIFO_RX_CURRENT_ADDR, 0x00 };
+  uint8_t set_ptr[2] = { REG_FIFO_ADDR_PTR | 0x80, 0 };
+  uint8_t fifo[HAL_SPI_MAX_LEN];
+  bool ok = (irqflags & IRQ_PAYLOAD_CRC_ERROR) == 0;
+
+  //  payload crc: 0x20
+  if (!ok) {
+    // clear rxDone, crc error and a ValidHeader not consumed by streaming
+    clear_irq[1] = irqflags & (IRQ_RX_DONE | IRQ_PAYLOAD_CRC_ERROR | IRQ_VALID_HEADER);
+    SpiXfer_t xfers[2] = {
+      { clear_irq, NULL, 2 },
+      { check, check, 2 },
+    };
+    hal->spi_transfer(r->bus, xfers, 2);
+    st->active = false;
+    r->pending_to_ns = MonotonicNs();
+    r->rx_pending = check[1] != currentAddr;
+    return false;
+  }
+
+  p_pkt->length = receivedCount;
+
+  // bytes already streamed out during reception, if they belong to this
+  // packet only the tail is left to read
+  uint8_t done = 0;
+  if (st->active && st->start == currentAddr && st->drained <= receivedCount) {
+    done = st->drained;
+    memcpy(p_pkt->payload, st->buf, done);
+  }
+  st->active = false;
+
+  // clear irq, check, rewind the FIFO pointer and drain the payload as one
+  // queued batch of transfers
+  clear_irq[1] = irqflags & (IRQ_RX_DONE | IRQ_VALID_HEADER);
+  set_ptr[1] = (uint8_t)(currentAddr + done);
+  fifo[0] = REG_FIFO;
+  memset(fifo + 1, 0x00, receivedCount - done);
+
+  SpiXfer_t xfers[4] = {
+    { clear_irq, NULL, 2 },
+    { check, check, 2 },
+    { set_ptr, NULL, 2 },
+    { fifo, fifo, (uint16_t)(receivedCount - done + 1) },
+  };
+  hal->spi_transfer(r->bus, xfers, done < receivedCount ? 4 : 2);
+  r->pending_to_ns = MonotonicNs();
+  r->rx_pending = check[1] != currentAddr;
+
+  memcpy(p_pkt->payload + done, fifo + 1, receivedCount - done);
+  if (done > 0) {
+    StatCount(r, &r->rx_streamed);
+  }
+  return true;
+}
+
+// Registers that change under our feet are never cached and go straight to
+// the chip: FIFO, status, counters and mode, the frequency error of the
+// last frame, the wideband RSSI, and what the chip writes itself at image
+// calibration (RegFormerTemp, 0x5B on the SX1276 and 0x6C on the SX1272).
+// 0x3C-0x3F hold the temperature and the FSK IRQ flags and are reserved in
+// LoRa mode, nothing says they keep still.
+static bool RegVolatile(uint8_t addr)
+{
+  return addr == REG_FIFO || addr == REG_OPMODE || addr == REG_FIFO_ADDR_PTR ||
+         addr == REG_FIFO_RX_CURRENT_ADDR ||
+         (addr >= REG_IRQ_FLAGS && addr <= 0x1C) ||
+         addr == REG_FIFO_RX_BYTE_ADDR ||
+         (addr >= REG_FEI_MSB && addr <= REG_FEI_LSB) || addr == 0x2C ||
+         (addr >= 0x3C && addr <= 0x3F) || addr == 0x5B || addr == 0x6C ||
+         addr >= SHADOW_SIZE;
+}
+
+// Forget everything, e.g. after a chip reset
+static void ShadowInvalidate(Radio_t* r)
+{
+  memset(&r->shadow, 0, sizeof(r->shadow));
+}
+
+// Fill the shadow from the chip with one burst read, so writes of values
+// already there are skipped and short gaps between dirty runs can be bridged
+static void ShadowLoad(Radio_t* r)
+{
+  uint8_t regs[SHADOW_SIZE];
+  RegShadow_t* sh = &r->shadow;
+
+  ReadRegisters(r, 0x01, regs + 1, SHADOW_SIZE - 1);
+  for (int addr = 1; addr < SHADOW_SIZE; addr++) {
+    if (!RegVolatile(addr)) {
+      sh->value[addr] = regs[addr];
+      sh->known[addr] = true;
+      sh->dirty[addr] = false;
+    }
+  }
+}
+
+static void ShadowWrite(Radio_t* r, uint8_t addr, uint8_t value)
+{
+  RegShadow_t* sh = &r->shadow;
+
+  if (RegVolatile(addr)) {
+    WriteRegister(r, addr, value);
+    return;
+  }
+  if (sh->known[addr] && sh->value[addr] == value && !sh->dirty[addr]) {
+    return;
+  }
+  sh->value[addr] = value;
+  sh->known[addr] = true;
+  sh->dirty[addr] = true;
+}
+
+static uint8_t ShadowRead(Radio_t* r, uint8_t addr)
+{
+  RegShadow_t* sh = &r->shadow;
+
+  if (RegVolatile(addr)) {
+    return ReadRegister(r, addr);
+  }
+  if (!sh->known[addr]) {
+    sh->value[addr] = ReadRegister(r, addr);
+    sh->known[addr] = true;
+  }
+  return sh->value[addr];
+}
+
+// Write all dirty registers. Consecutive ones, and runs separated by a
+// known clean register, go out as one burst; all bursts are queued
+// together.
+static void ShadowFlush(Radio_t* r)
+{
+  uint8_t bufs[HAL_SPI_MAX_XFERS][SHADOW_SIZE + 1];
+  SpiXfer_t xfers[HAL_SPI_MAX_XFERS];
+  RegShadow_t* sh = &r->shadow;
+  int count = 0;
+  int addr = 0;
+
+  while (addr < SHADOW_SIZE) {
+    if (!sh->dirty[addr]) {
+      addr++;
+      continue;
+    }
+
+    int first = addr;
+    int last = addr;
+    for (int a = addr + 1; a < SHADOW_SIZE; a++) {
+      if (sh->dirty[a]) {
+        last = a;
+      } else if (!sh->known[a] || RegVolatile(a) ||
+                 a + 1 >= SHADOW_SIZE || !sh->dirty[a + 1]) {
+        break;
+      }
+    }
+
+    if (count == HAL_SPI_MAX_XFERS) {
+      hal->spi_transfer(r->bus, xfers, count);
+      count = 0;
+    }
+    bufs[count][0] = first | 0x80;
+    memcpy(&bufs[count][1], &sh->value[first], last - first + 1);
+    xfers[count].tx = bufs[count];
+    xfers[count].rx = NULL;
+    xfers[count].len = last - first + 2;
+    count++;
+
+    for (int a = first; a <= last; a++) {
+      sh->dirty[a] = false;
+    }
+    addr = last + 1;
+  }
+
+  if (count > 0) {
+    hal->spi_transfer(r->bus, xfers, count);
+  }
+}
+
+// Read the whole register file back in one burst and compare it with the
+// shadow. Returns the number of registers that do not match.
+static int ShadowVerify(Radio_t* r)
+{
+  uint8_t regs[SHADOW_SIZE];
+  RegShadow_t* sh = &r->shadow;
+  int mismatch = 0;
+
+  ShadowFlush(r);
+  ReadRegisters(r, 0x01, regs + 1, SHADOW_SIZE - 1);
+
+  for (int addr = 1; addr < SHADOW_SIZE; addr++) {
+    if (sh->known[addr] && !RegVolatile(addr) && sh->value[addr] != regs[addr]) {
+      printf("Radio %d: register 0x%02X is 0x%02X, expected 0x%02X\n", r->id, addr, regs[addr], sh->value[addr]);
+      sh->value[addr] = regs[addr];
+      mismatch++;
+    }
+  }
+  pthread_mutex_lock(&r->lock);
+  r->shadow_mismatch += mismatch;
+  pthread_mutex_unlock(&r->lock);
+  return mismatch;
+}
+
+// Copy whatever the modem wrote to the FIFO since the last call
+static void StreamDrain(Radio_t* r)
+{
+  RxStream_t* st = &r->rx_stream;
+  uint8_t last = ReadRegister(r, REG_FIFO_RX_BYTE_ADDR);
+  uint8_t avail = (uint8_t)(last + 1 - st->start - st->drained);
+
+  if (avail == 0 || st->drained + avail > 255) {
+    return;
+  }
+
+  uint8_t set_ptr[2] = { REG_FIFO_ADDR_PTR | 0x80, (uint8_t)(st->start + st->drained) };
+  uint8_t fifo[HAL_SPI_MAX_LEN];
+  fifo[0] = REG_FIFO;
+  memset(fifo + 1, 0x00, avail);
+
+  SpiXfer_t xfers[2] = {
+    { set_ptr, NULL, 2 },
+    { fifo, fifo, (uint16_t)(avail + 1) },
+  };
+  hal->spi_transfer(r->bus, xfers, 2);
+
+  memcpy(st->buf + st->drained, fifo + 1, avail);
+  st->drained += avail;
+}
+
+// Called on ValidHeader. Drains the FIFO every STREAM_CHUNK bytes of airtime
+// until RxDone fires, whose timestamp is stored in *p_irq_ns.
+// ReceivePkt checks the streamed bytes against the final RX address.
+static void StreamPacket(Radio_t* r, uint64_t* p_irq_ns)
+{
+  RxStream_t* st = &r->rx_stream;
+  uint64_t deadline = MonotonicNs() + STREAM_TIMEOUT_MS * 1000000ULL;
+
+  // nothing of the payload is written yet, it starts after the last byte
+  WriteRegister(r, REG_IRQ_FLAGS, IRQ_VALID_HEADER);
+  st->start = ReadRegister(r, REG_FIFO_RX_BYTE_ADDR) + 1;
+  st->drained = 0;
+  st->active = true;
+
+  struct pollfd pfd = { r->irq_fd, POLLIN, 0 };
+  while (1) {
+    int ret = poll(&pfd, 1, r->stream_poll_ms);
+    if (ret > 0 && (pfd.revents & POLLIN)) {
+      hal->irq_ack(r->dio0, p_irq_ns);
+      return;
+    }
+    if (ret < 0 || MonotonicNs() > deadline) {
+      st->active = false;
+      return;
+    }
+    StreamDrain(r);
+  }
+}
+
+static char * PinName(int pin, char * buff) {
+  strcpy(buff, "unused");
+  if (pin != 0xff) {
+    sprintf(buff, "%d", pin);
+  }
+  return buff;
+}
+
+// Frequency and modem registers for a channel / data rate, written through
+// the shadow so only what changed goes out. Returns false if the
+// combination is not supported, nothing is touched then.
+static bool ConfigureModem(Radio_t* r, uint32_t new_freq, SpreadingFactor_t new_sf, uint16_t new_bw)
+{
+  const ModemConf_t* conf = ModemLookup(r->sx1272, new_sf, new_bw, r->cr);
+  if (conf == NULL) {
+    return false;
+  }
+
+  // set frequency
+  uint64_t frf = ((uint64_t)new_freq << 19) / 32000000;
+  ShadowWrite(r, REG_FRF_MSB, (uint8_t)(frf >> 16) );
+  ShadowWrite(r, REG_FRF_MID, (uint8_t)(frf >> 8) );
+  ShadowWrite(r, REG_FRF_LSB, (uint8_t)(frf >> 0) );
+
+  ShadowWrite(r, REG_MODEM_CONFIG, conf->mc1);
+  ShadowWrite(r, REG_MODEM_CONFIG2, conf->mc2);
+  ShadowWrite(r, REG_SYMB_TIMEOUT_LSB, conf->symb_timeout);
+  if (!r->sx1272) {
+    ShadowWrite(r, REG_MODEM_CONFIG3, conf->mc3);
+  }
+
+  r->freq = new_freq;
+  r->sf = new_sf;
+  r->bw = new_bw;
+  r->modem_conf = conf;
+  return true;
+}
+
+// Airtime of STREAM_CHUNK payload bytes at the current data rate
+static int ChunkAirtimeMs(Radio_t* r)
+{
+  uint32_t bps = r->sf * r->bw * 1000 * 4 / r->cr / (1 << r->sf);
+  int ms = STREAM_CHUNK * 8 * 1000 / bps;
+  return ms < 1 ? 1 : ms;
+}
+
+// Standby, rewrite only the FRF / modem registers that changed, back to
+// continuous RX. An unsupported combination leaves the chip alone, a frame
+// being received is not lost for it.
+long Retune(Radio_t* r, uint32_t new_freq, SpreadingFactor_t new_sf, uint16_t new_bw)
+{
+  uint64_t start = MonotonicNs();
+
+  if (ModemLookup(r->sx1272, new_sf, new_bw, r->cr) == NULL) {
+    return -1;
+  }
+
+  WriteRegister(r, REG_OPMODE, SX72_MODE_STANDBY);
+  ConfigureModem(r, new_freq, new_sf, new_bw);
+  ShadowFlush(r);
+
+  // drop anything half received on the previous channel
+  WriteRegister(r, REG_IRQ_FLAGS, 0xFF);
+  r->rx_stream.active = false;
+  r->fifo_valid = false;
+  r->rx_pending = false;
+  r->stream_poll_ms = ChunkAirtimeMs(r);
+
+  WriteRegister(r, REG_OPMODE, SX72_MODE_RX_CONTINUOS);
+
+  return (long)((MonotonicNs() - start) / 1000);
+}
+
+// Symbol time at the current SF/BW
+static uint32_t SymbolUs(Radio_t* r)
+{
+  return (1000 << r->sf) / r->bw;
+}
+
+// Wait for a rising DIO0 up to timeout_ms, on edge events when available,
+// else by polling the level. Returns true with the edge time in *p_irq_ns.
+static bool WaitDio0(Radio_t* r, int timeout_ms, uint64_t* p_irq_ns)
+{
+  if (r->irq_fd >= 0) {
+    struct pollfd pfd = { r->irq_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN)) {
+      hal->irq_ack(r->dio0, p_irq_ns);
+      return true;
+    }
+    return false;
+  }
+
+  uint64_t deadline = MonotonicNs() + timeout_ms * 1000000ULL;
+  while (hal->digital_read(r->dio0) != HAL_HIGH) {
+    if (MonotonicNs() > deadline) {
+      return false;
+    }
+    hal->delay_ms(1);
+  }
+  *p_irq_ns = MonotonicNs();
+  return true;
+}
+
+// Drop edges left over from a previous operation
+static void FlushDio0(Radio_t* r)
+{
+  uint64_t ns;
+  struct pollfd pfd = { r->irq_fd, POLLIN, 0 };
+  if (r->irq_fd >= 0 && poll(&pfd, 1, 0) > 0) {
+    hal->irq_ack(r->dio0, &ns);
+  }
+}
+
+// irq_ns is the CLOCK_MONOTONIC time of the RxDone edge, 0 if unknown.
+// Hands the frame to the rx handler, returns true if its CRC was good.
+static bool Receivepacket(Radio_t* r, uint64_t irq_ns)
+{
+  RxPacket_t pkt;
+  uint32_t irq_err_us = 0;
+
+  if (r->rx_pending) {
+    // its RxDone was cleared with the previous frame, DIO0 stays low and
+    // there is no edge: it came between the two reads of the current
+    // address, take the middle
+    r->rx_pending = false;
+    StatCount(r, &r->rx_caught_up);
+    irq_ns = r->pending_from_ns + (r->pending_to_ns - r->pending_from_ns) / 2;
+    irq_err_us = (uint32_t)((r->pending_to_ns - r->pending_from_ns) / 2000) + 1;
+  } else if (hal->digital_read(r->dio0) != HAL_HIGH) {
+    return false;
+  }
+  if (irq_ns == 0) {
+    // polled, the level was just seen high
+    irq_ns = MonotonicNs();
+  }
+
+  pkt.crc_ok = ReceivePkt(r, &pkt);
+  pkt.drained_ns = MonotonicNs();
+  pkt.irq_ns = irq_ns;
+  pkt.irq_err_us = irq_err_us;
+  pkt.rfch = r->id;
+  pkt.chan = r->chan_base + (r->hop_nb > 0 ? r->hop_cur : 0);
+  pkt.sx1272 = r->sx1272;
+  pkt.freq = r->freq;
+  pkt.modem_conf = r->modem_conf;
+
+  if (pkt.crc_ok && r->hop_nb > 0) {
+    pthread_mutex_lock(&r->lock);
+    r->hop_channels[r->hop_cur].rx_nb++;
+    r->hop_channels[r->hop_cur].rx_tot++;
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  r->rx_handler(&pkt);
+  return pkt.crc_ok;
+}
+
+// Earliest deadline first: the SF whose preamble window closes first goes
+// next, so fast SFs are revisited between two slow CADs.
+static CadSlot_t* CadNext(Radio_t* r)
+{
+  CadSlot_t* next = &r->cad_slots[0];
+  for (int i = 1; i < r->cad_nb; i++) {
+    if (r->cad_slots[i].due_ns < next->due_ns) {
+      next = &r->cad_slots[i];
+    }
+  }
+  return next;
+}
+
+// Start the radio on op (CAD or RX single) with DIO0 mapped to map
+static void CadStart(Radio_t* r, uint8_t map, uint8_t op)
+{
+  ShadowWrite(r, REG_DIO_MAPPING_1, map);
+  ShadowFlush(r);
+  WriteRegister(r, REG_IRQ_FLAGS, 0xFF);
+  FlushDio0(r);
+  r->fifo_valid = false;
+  WriteRegister(r, REG_OPMODE, op);
+}
+
+// One step of the CAD rotation: CAD on the SF that is due, and if a
+// preamble is there receive the packet on that SF. rxpk then carries the
+// SF it was heard on.
+static void CadStep(Radio_t* r)
+{
+  CadSlot_t* slot = CadNext(r);
+  uint64_t irq_ns = 0;
+
+  WriteRegister(r, REG_OPMODE, SX72_MODE_STANDBY);
+  if (!ConfigureModem(r, r->freq, slot->sf, r->bw)) {
+    // RadioSetup() left unsupported ones out, never count on a stale SF
+    slot->due_ns = MonotonicNs() + 1000000000ULL;
+    return;
+  }
+  uint32_t tsym = SymbolUs(r);
+
+  uint64_t start = MonotonicNs();
+  CadStart(r, MAP_DIO0_LORA_CADDONE, SX72_MODE_CAD);
+  StatCount(r, &slot->cad_nb);
+  slot->due_ns = start + (uint64_t)(CAD_PREAMBLE_SYMBOLS - CAD_SYMBOLS) * tsym * 1000;
+
+  if (!WaitDio0(r, 2 * CAD_SYMBOLS * tsym / 1000 + 1, &irq_ns)) {
+    return;
+  }
+  if ((ReadRegister(r, REG_IRQ_FLAGS) & IRQ_CAD_DETECTED) == 0) {
+    return;
+  }
+  StatCount(r, &slot->detected);
+
+  // Preamble and header first, the whole packet once the header is valid
+  CadStart(r, MAP_DIO0_LORA_RXDONE, SX72_MODE_RX_SINGLE);
+  uint64_t deadline = MonotonicNs() + (uint64_t)(CAD_PREAMBLE_SYMBOLS + r->modem_conf->symb_timeout + 13) * tsym * 1000;
+  bool header = false;
+
+  while (1) {
+    if (WaitDio0(r, 4 * tsym / 1000 + 1, &irq_ns)) {
+      StatCount(r, Receivepacket(r, irq_ns) ? &slot->caught : &slot->missed);
+      return;
+    }
+
+    uint8_t flags = ReadRegister(r, REG_IRQ_FLAGS);
+    if (flags & IRQ_RX_TIMEOUT) {
+      StatCount(r, &slot->missed);
+      return;
+    }
+    if ((flags & IRQ_VALID_HEADER) && !header) {
+      header = true;
+      // longest payload we accept, 4/cr coded at SF bits per symbol
+      deadline += (uint64_t)(0x80 * 8 * r->cr / 4 / r->sf + 8) * tsym * 1000;
+    }
+    if (MonotonicNs() > deadline) {
+      StatCount(r, &slot->missed);
+      return;
+    }
+  }
+}
+
+// Share the hop cycle (hop_nb * hop_dwell_ms) between channels by how much
+// traffic each one had per mean dwell, +1 so that quiet channels are still
+// visited, and never less than a quarter of the mean dwell. Counts are
+// scaled by the time spent listening, or a channel that just got busy
+// would be held back by the short dwell it had while quiet.
+static void HopSchedule(Radio_t* r)
+{
+  uint32_t weight[HOP_MAX_CHANNELS];
+  uint32_t total = 0;
+
+  pthread_mutex_lock(&r->lock);
+  for (int i = 0; i < r->hop_nb; i++) {
+    HopChannel_t* ch = &r->hop_channels[i];
+    weight[i] = (uint64_t)ch->rx_nb * r->hop_dwell_ms / (ch->dwell_ms > 0 ? ch->dwell_ms : r->hop_dwell_ms) + 1;
+    total += weight[i];
+  }
+  for (int i = 0; i < r->hop_nb; i++) {
+    HopChannel_t* ch = &r->hop_channels[i];
+    uint32_t dwell = (uint64_t)r->hop_nb * r->hop_dwell_ms * weight[i] / total;
+    ch->dwell_ms = dwell < r->hop_dwell_ms / 4 ? r->hop_dwell_ms / 4 : dwell;
+    // forget old traffic quickly so the plan follows the devices
+    ch->rx_nb /= 4;
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Milliseconds until the next hop is due, -1 when not hopping
+static int HopWaitMs(Radio_t* r)
+{
+  if (r->hop_nb < 2) {
+    return -1;
+  }
+  uint64_t now = MonotonicNs();
+  return now >= r->hop_next_ns ? 0 : (int)((r->hop_next_ns - now + 999999) / 1000000);
+}
+
+// Move to the next channel once the dwell time is over, unless a packet is
+// being received right now.
+static void HopCheck(Radio_t* r)
+{
+  if (HopWaitMs(r) != 0) {
+    return;
+  }
+
+  uint64_t now = MonotonicNs();
+  if (ReadRegister(r, REG_MODEM_STAT) & (MODEM_STAT_SIGNAL_DETECTED | MODEM_STAT_SIGNAL_SYNC)) {
+    r->hop_next_ns = now + ChunkAirtimeMs(r) * 1000000ULL;
+    return;
+  }
+
+  r->hop_cur = (r->hop_cur + 1) % r->hop_nb;
+  if (r->hop_cur == 0) {
+    HopSchedule(r);
+  }
+  HopChannel_t* ch = &r->hop_channels[r->hop_cur];
+  long us = Retune(r, ch->freq, r->sf, r->bw);
+  r->hop_next_ns = now + ch->dwell_ms * 1000000ULL;
+
+  pthread_mutex_lock(&r->lock);
+  r->retune_nb++;
+  if (us > (long)r->retune_max_us) {
+    r->retune_max_us = us;
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+void RadioInit(Radio_t* r, int id)
+{
+  memset(r, 0, sizeof(Radio_t));
+  r->id = id;
+  r->spi_speed = SPI_SPEED_DEFAULT;
+  r->nss = HAL_PIN_UNUSED;
+  r->dio0 = HAL_PIN_UNUSED;
+  r->rst = HAL_PIN_UNUSED;
+  r->dio3 = HAL_PIN_UNUSED;
+  r->freq = 868100000;     // 868.1 Mhz
+  r->sf = SF7;
+  r->bw = 125;
+  r->cr = 5;
+  r->hop_dwell_ms = 2000;
+  r->bus = -1;
+  r->irq_fd = -1;
+  r->hdr_fd = -1;
+  r->stream_poll_ms = 1;
+  r->rt_cpu = -1;
+  pthread_mutex_init(&r->lock, NULL);
+}
+
+// Write / read back patterns on REG_FIFO_TX_BASE_AD, never used by a
+// receiver, and a burst through the FIFO like a payload read out. The chip
+// has to be in LoRa standby.
+static bool SpiCheck(Radio_t* r)
+{
+  static const uint8_t patterns[] = { 0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x5A, 0xA5 };
+  uint8_t burst[SPI_CAL_BURST];
+  uint8_t back[SPI_CAL_BURST];
+
+  for (int round = 0; round < SPI_CAL_ROUNDS; round++) {
+    uint8_t value = patterns[round % sizeof(patterns)] ^ (uint8_t)round;
+    WriteRegister(r, REG_FIFO_TX_BASE_AD, value);
+    if (ReadRegister(r, REG_FIFO_TX_BASE_AD) != value) {
+      return false;
+    }
+  }
+
+  for (int i = 0; i < SPI_CAL_BURST; i++) {
+    burst[i] = patterns[i % sizeof(patterns)] ^ (uint8_t)(i * 7);
+  }
+  WriteRegister(r, REG_FIFO_ADDR_PTR, 0x00);
+  WriteRegisters(r, REG_FIFO, burst, SPI_CAL_BURST);
+  WriteRegister(r, REG_FIFO_ADDR_PTR, 0x00);
+  ReadRegisters(r, REG_FIFO, back, SPI_CAL_BURST);
+  return memcmp(burst, back, SPI_CAL_BURST) == 0;
+}
+
+// Step the clock up to spi_speed and keep the fastest one every check
+// passes at. Stops at the first failure, a marginal clock only gets worse
+// with temperature. Returns false if a check failed: garbled transfers may
+// have hit any register, the chip needs a reset then.
+static bool SpiCalibrate(Radio_t* r)
+{
+  static const uint32_t steps[] = { 500000, 1000000, 2000000, 4000000, 6000000, 8000000, 10000000 };
+  uint32_t good = SPI_SPEED_DEFAULT;
+  bool ok = true;
+
+  WriteRegister(r, REG_OPMODE, SX72_MODE_SLEEP);
+  WriteRegister(r, REG_OPMODE, SX72_MODE_STANDBY);
+  for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]) && steps[i] <= r->spi_speed; i++) {
+    if (hal->spi_set_speed(r->bus, steps[i]) < 0) {
+      break;
+    }
+    if (!SpiCheck(r)) {
+      ok = false;
+      break;
+    }
+    good = steps[i];
+  }
+  hal->spi_set_speed(r->bus, good);
+  r->spi_speed = good;
+  WriteRegister(r, REG_FIFO_TX_BASE_AD, 0x80);   // reset value
+  return ok;
+}
+
+// Mean time of a single register read, at the current clock
+static void SpiMeasure(Radio_t* r)
+{
+  uint64_t start = MonotonicNs();
+  for (int i = 0; i < SPI_CAL_ROUNDS; i++) {
+    ReadRegister(r, REG_VERSION);
+  }
+  r->spi_rtt_ns = (MonotonicNs() - start) / SPI_CAL_ROUNDS;
+}
+
+// Pulse the reset pin to level for RESET_PULSE_MS and wait until the chip
+// is ready. SX1272 reset is active high, SX1276 active low.
+static void ResetPulse(Radio_t* r, int level)
+{
+  hal->digital_write(r->rst, level);
+  hal->delay_ms(RESET_PULSE_MS);
+  hal->digital_write(r->rst, level == HAL_HIGH ? HAL_LOW : HAL_HIGH);
+  hal->delay_ms(RESET_READY_MS);
+}
+
+// Registers 0x0D-0x3F are another set in FSK mode, where the chip comes
+// out of reset, and LongRangeMode only changes in sleep: FSK sleep first,
+// then LoRa sleep, until the chip reports it.
+static bool EnterLoRa(Radio_t* r)
+{
+  WriteRegister(r, REG_OPMODE, SX72_MODE_SLEEP & ~OPMODE_LONG_RANGE);
+  for (int i = 0; i < LORA_MODE_TRIES; i++) {
+    WriteRegister(r, REG_OPMODE, SX72_MODE_SLEEP);
+    if (ReadRegister(r, REG_OPMODE) & OPMODE_LONG_RANGE) {
+      return true;
+    }
+    hal->delay_ms(1);
+  }
+  return false;
+}
+
+static bool SetupLoRa(Radio_t* r)
+{
+  char nss[16], dio0[16], rst[16];
+
+  PinName(r->nss, nss);
+  PinName(r->dio0, dio0);
+  PinName(r->rst, rst);
+
+  ResetPulse(r, HAL_HIGH);
+  uint8_t version = ReadRegister(r, REG_VERSION);
+
+  if (version == 0x22) {
+    // sx1272
+    r->sx1272 = true;
+  } else {
+    // sx1276?
+    ResetPulse(r, HAL_LOW);
+    version = ReadRegister(r, REG_VERSION);
+    if (version == 0x12) {
+      // sx1276
+      r->sx1272 = false;
+    } else {
+      printf("Radio %d: NSS=%s DIO0=%s Reset=%s, unrecognized transceiver version 0x%02X\n",
+             r->id, nss, dio0, rst, version);
+      return false;
+    }
+  }
+  if (r->spi_calibrate && !SpiCalibrate(r)) {
+    ResetPulse(r, r->sx1272 ? HAL_HIGH : HAL_LOW);
+  }
+  SpiMeasure(r);
+  printf("Radio %d: NSS=%s DIO0=%s Reset=%s, %s detected, SPI %.1f MHz, %u us per register read, starting.\n",
+         r->id, nss, dio0, rst, r->sx1272 ? "SX1272" : "SX1276", r->spi_speed / 1e6, (r->spi_rtt_ns + 500) / 1000);
+
+  ShadowInvalidate(r);
+  // the shadow is loaded from, and verified against, the LoRa registers
+  if (!EnterLoRa(r)) {
+    printf("Radio %d: does not switch to LoRa mode, RegOpMode 0x%02X\n", r->id, ReadRegister(r, REG_OPMODE));
+    return false;
+  }
+  ShadowLoad(r);
+
+  ShadowWrite(r, REG_SYNC_WORD, 0x34); // LoRaWAN public sync word
+
+  if (!ConfigureModem(r, r->freq, r->sf, r->bw)) {
+    printf("Radio %d: unsupported modem configuration SF%d BW%d CR4/%d\n", r->id, r->sf, r->bw, r->cr);
+    return false;
+  }
+
+  ShadowWrite(r, REG_MAX_PAYLOAD_LENGTH, 0x80);
+  ShadowWrite(r, REG_PAYLOAD_LENGTH, PAYLOAD_LENGTH);
+  ShadowWrite(r, REG_HOP_PERIOD, 0xFF);
+  ShadowWrite(r, REG_FIFO_ADDR_PTR, ShadowRead(r, REG_FIFO_RX_BASE_AD));
+
+  // RxDone on DIO0, ValidHeader on DIO3
+  ShadowWrite(r, REG_DIO_MAPPING_1, MAP_DIO0_LORA_RXDONE | MAP_DIO3_LORA_VALIDHEADER);
+
+  // Set Continous Receive Mode
+  ShadowWrite(r, REG_LNA, LNA_MAX_GAIN);  // max lna gain
+  if (ShadowVerify(r) > 0) {
+    printf("Radio %d: configuration did not stick\n", r->id);
+  }
+  WriteRegister(r, REG_OPMODE, SX72_MODE_RX_CONTINUOS);
+  return true;
+}
+
+bool RadioSetup(Radio_t* r)
+{
+  // check basic
+  if (r->nss == HAL_PIN_UNUSED || r->dio0 == HAL_PIN_UNUSED) {
+    printf("Radio %d: bad pin configuration, pin_nss and pin_dio0 need at least to be defined\n", r->id);
+    return false;
+  }
+
+  // detection at the safe clock, calibration comes after
+  uint32_t spi_speed = r->spi_calibrate ? SPI_SPEED_DEFAULT : r->spi_speed;
+  r->bus = hal->open(r->spi_channel, spi_speed, r->nss);
+  if (r->bus < 0) {
+    printf("Radio %d: cannot open SPI bus\n", r->id);
+    return false;
+  }
+  hal->pin_mode(r->dio0, HAL_INPUT, HAL_LOW);
+  // high is where the detection below starts: idle for an SX1276, and the
+  // start of the first reset pulse for an SX1272
+  hal->pin_mode(r->rst, HAL_OUTPUT, HAL_HIGH);
+
+  if (!SetupLoRa(r)) {
+    return false;
+  }
+
+  // RxDone as DIO0 edge events, otherwise fall back to polling the level
+  r->irq_fd = hal->irq_enable(r->dio0);
+  if (r->irq_fd < 0) {
+    printf("Radio %d: DIO0 edge events not available, polling\n", r->id);
+  }
+
+  if (r->hop_nb > 0) {
+    // start on the first channel of the plan
+    HopSchedule(r);
+    r->hop_cur = 0;
+    Retune(r, r->hop_channels[0].freq, r->sf, r->bw);
+    r->hop_next_ns = MonotonicNs() + r->hop_channels[0].dwell_ms * 1000000ULL;
+    printf("Radio %d: hopping over %d channels, %u ms mean dwell\n", r->id, r->hop_nb, r->hop_dwell_ms);
+  }
+
+  // The rotation keeps the spreading factors this chip supports at bw / cr
+  int cad_nb = 0;
+  for (int i = 0; i < r->cad_nb; i++) {
+    if (ModemLookup(r->sx1272, r->cad_slots[i].sf, r->bw, r->cr) == NULL) {
+      printf("Radio %d: CAD on SF%d not supported, left out\n", r->id, r->cad_slots[i].sf);
+    } else {
+      r->cad_slots[cad_nb++] = r->cad_slots[i];
+    }
+  }
+  if (r->cad_nb > 0 && cad_nb == 0) {
+    printf("Radio %d: no CAD spreading factor left\n", r->id);
+    return false;
+  }
+  r->cad_nb = cad_nb;
+
+  // ValidHeader on DIO3 starts draining the FIFO during reception
+  if (r->cad_nb > 0) {
+    printf("Radio %d: CAD receive on %d spreading factors\n", r->id, r->cad_nb);
+  } else if (r->stream_rx) {
+    if (r->irq_fd >= 0 && r->dio3 != HAL_PIN_UNUSED) {
+      r->hdr_fd = hal->irq_enable(r->dio3);
+    }
+    if (r->hdr_fd < 0) {
+      printf("Radio %d: streaming RX needs DIO3 edge events, disabled\n", r->id);
+    } else {
+      r->stream_poll_ms = ChunkAirtimeMs(r);
+      printf("Radio %d: streaming RX, draining every %d ms\n", r->id, r->stream_poll_ms);
+    }
+  }
+  return true;
+}
+
+// Stack the radio thread touches before its first frame in real-time mode,
+// Receivepacket() and the SPI transfers stay well within it
+#define RT_STACK_PREFAULT (64 * 1024)
+
+static void __attribute__((noinline)) StackPrefault()
+{
+  uint8_t stack[RT_STACK_PREFAULT];
+  memset(stack, 0, sizeof(stack));
+  __asm__ __volatile__("" : : "r"(stack) : "memory");  // keep the writes
+}
+
+// Pin and raise the calling radio thread, each refusal is reported and the
+// thread goes on as it is
+static void RealtimeThread(Radio_t* r)
+{
+  if (r->rt_cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(r->rt_cpu, &cpus);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0) {
+      printf("Radio %d: cannot pin to CPU %d: %s\n", r->id, r->rt_cpu, strerror(ret));
+    }
+  }
+  if (r->rt_priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = r->rt_priority;
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0) {
+      // EPERM without CAP_SYS_NICE or a high enough RLIMIT_RTPRIO
+      printf("Radio %d: no SCHED_FIFO priority %d: %s\n", r->id, r->rt_priority, strerror(ret));
+    }
+    StackPrefault();
+  }
+  fflush(stdout);
+}
+
+static void* RadioLoop(void* arg)
+{
+  Radio_t* r = (Radio_t*)arg;
+  uint64_t irq_ns = 0;
+
+  RealtimeThread(r);
+
+  while (1) {
+    if (r->cad_nb > 0) {
+      CadStep(r);
+    } else if (r->irq_fd >= 0) {
+      // Sleep until RxDone or until the next hop is due
+      struct pollfd pfd[2] = { { r->irq_fd, POLLIN, 0 }, { r->hdr_fd, POLLIN, 0 } };
+      if (poll(pfd, r->hdr_fd >= 0 ? 2 : 1, HopWaitMs(r)) > 0) {
+        uint64_t hdr_ns;
+        if (pfd[0].revents & POLLIN) {
+          hal->irq_ack(r->dio0, &irq_ns);
+          if (r->hdr_fd >= 0 && (pfd[1].revents & POLLIN)) {
+            // short packet, header and RxDone came in together
+            hal->irq_ack(r->dio3, &hdr_ns);
+          }
+        } else if (r->hdr_fd >= 0 && (pfd[1].revents & POLLIN)) {
+          hal->irq_ack(r->dio3, &hdr_ns);
+          StreamPacket(r, &irq_ns);
+        }
+      }
+    }
+
+    // rx packet, also picks up a DIO0 already high before edges were armed
+    if (r->cad_nb == 0) {
+      Receivepacket(r, irq_ns);
+      while (r->rx_pending) {
+        Receivepacket(r, 0);
+      }
+      irq_ns = 0;
+    }
+    HopCheck(r);
+
+    // Let some time to the OS
+    if (r->irq_fd < 0 && r->cad_nb == 0) {
+      hal->delay_ms(1);
+    }
+  }
+  return NULL;
+}
+
+bool RadioStart(Radio_t* r, RxHandler_t handler)
+{
+  r->rx_handler = handler;
+  return HalThreadCreate(&r->thread, RadioLoop, r) == 0;
+}
+
+void RadioPrintStats(Radio_t* r)
+{
+  pthread_mutex_lock(&r->lock);
+  printf(" radio %d: SPI %.1f MHz, %u ns per register read\n", r->id, r->spi_speed / 1e6, r->spi_rtt_ns);
+  if (r->shadow_mismatch > 0) {
+    printf(" radio %d: %u register%s lost since start\n", r->id, r->shadow_mismatch, r->shadow_mismatch > 1 ? "s" : "");
+  }
+  for (int i = 0; i < r->hop_nb; i++) {
+    printf(" chan %d %.6lf Mhz: %u packets, %u ms dwell\n", r->chan_base + i, (double)r->hop_channels[i].freq / 1000000,
+           r->hop_channels[i].rx_tot, r->hop_channels[i].dwell_ms);
+  }
+  if (r->rx_overrun > 0 || r->rx_caught_up > 0) {
+    printf(" radio %d: %u frames lost in the FIFO, %u back to back frames caught up\n", r->id,
+           r->rx_overrun, r->rx_caught_up);
+  }
+  if (r->rx_streamed > 0) {
+    printf(" radio %d: %u frames streamed out during reception\n", r->id, r->rx_streamed);
+  }
+  if (r->retune_nb > 0) {
+    printf(" radio %d: %u hops, slowest switch %u us\n", r->id, r->retune_nb, r->retune_max_us);
+  }
+  for (int i = 0; i < r->cad_nb; i++) {
+    const CadSlot_t* slot = &r->cad_slots[i];
+    printf(" radio %d SF%d: %u CAD, %u preambles, %u caught, %u missed\n", r->id, slot->sf,
+           slot->cad_nb, slot->detected, slot->caught, slot->missed);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
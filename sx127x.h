@@ -0,0 +1,185 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// SX1272 / SX1276 receiver. Each Radio_t is one module on its own SPI chip
+// select and DIO pins, driven by its own thread once started. Received
+// frames, good or bad CRC, are handed to the RxHandler_t given to
+// RadioStart(), from that radio thread.
+
+#ifndef _SX127X_H
+#define _SX127X_H
+
+#include "hal.h"
+#include "sx127x_modem.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define RADIO_MAX         HAL_MAX_BUSES
+#define HOP_MAX_CHANNELS  16
+#define CAD_MAX_SF        6   // SF7 .. SF12
+
+#define SPI_SPEED_DEFAULT 500000
+#define SPI_SPEED_MAX     10000000  // SX127x limit
+
+// Last known register contents, only for registers the chip never changes
+// by itself. Writes are held back until ShadowFlush().
+#define SHADOW_SIZE 0x80
+
+typedef enum SpreadingFactors
+{
+    SF7 = 7,
+    SF8 = 8,
+    SF9 = 9,
+    SF10 = 10,
+    SF11 = 11,
+    SF12 = 12
+} SpreadingFactor_t;
+
+typedef struct RxMetadata
+{
+  uint8_t irqflags;
+  uint8_t snr;       /* raw REG_PKT_SNR_VALUE, two's complement, 0.25 dB */
+  uint8_t pkt_rssi;  /* raw REG_PKT_RSSI_VALUE */
+  uint8_t rssi;      /* raw REG_RSSI_VALUE */
+} RxMetadata_t;
+
+typedef struct RegShadow
+{
+  uint8_t value[SHADOW_SIZE];
+  bool known[SHADOW_SIZE];
+  bool dirty[SHADOW_SIZE];
+} RegShadow_t;
+
+// Payload bytes pulled out of the FIFO before RxDone in stream_rx mode
+typedef struct RxStream
+{
+  bool active;
+  uint8_t start;     /* FIFO address of the first payload byte */
+  uint8_t drained;   /* bytes already copied to buf */
+  uint8_t buf[256];
+} RxStream_t;
+
+// One spreading factor of the CAD rotation
+typedef struct CadSlot
+{
+  SpreadingFactor_t sf;
+  uint64_t due_ns;     /* latest CAD start that still sees a preamble */
+  uint32_t cad_nb;     /* CAD runs */
+  uint32_t detected;   /* preambles detected */
+  uint32_t caught;     /* detected and received with a valid CRC */
+  uint32_t missed;     /* detected but lost: timeout or CRC error */
+} CadSlot_t;
+
+// One uplink channel of the hopping plan
+typedef struct HopChannel
+{
+  uint32_t freq;
+  uint32_t rx_nb;      /* packets received, decayed every hop cycle */
+  uint32_t rx_tot;     /* packets received since start */
+  uint32_t dwell_ms;   /* current dwell time */
+} HopChannel_t;
+
+// A frame as read out of the FIFO, with what is needed to build its rxpk
+typedef struct RxPacket
+{
+  int rfch;                       /* radio id */
+  int chan;                       /* chan_base + hopping channel */
+  bool crc_ok;
+  bool sx1272;
+  uint32_t freq;
+  const ModemConf_t* modem_conf;  /* data rate it was received at */
+  uint64_t irq_ns;                /* RxDone edge, CLOCK_MONOTONIC */
+  uint32_t irq_err_us;            /* 0, or irq_ns estimated within this */
+  uint64_t drained_ns;            /* end of the FIFO read out */
+  RxMetadata_t meta;
+  uint8_t length;
+  uint8_t payload[256];
+} RxPacket_t;
+
+typedef void (*RxHandler_t)(const RxPacket_t* p_pkt);
+
+typedef struct Radio
+{
+  // Configuration, from global_conf.json
+  int id;
+  int spi_channel;
+  uint32_t spi_speed;             /* Hz, the upper bound with spi_calibrate */
+  bool spi_calibrate;             /* step the clock up at startup */
+  int nss;
+  int dio0;
+  int rst;
+  int dio3;                       /* only needed for stream_rx */
+  uint32_t freq;
+  SpreadingFactor_t sf;
+  uint16_t bw;                    /* kHz */
+  uint8_t cr;                     /* coding rate 4/cr */
+  bool stream_rx;
+  HopChannel_t hop_channels[HOP_MAX_CHANNELS];
+  int hop_nb;
+  uint32_t hop_dwell_ms;          /* mean dwell per channel */
+  CadSlot_t cad_slots[CAD_MAX_SF];
+  int cad_nb;
+  int chan_base;                  /* rxpk "chan" of hop_channels[0] */
+  int rt_priority;                /* SCHED_FIFO priority of the thread, 0 = normal */
+  int rt_cpu;                     /* core the thread is pinned to, -1 = any */
+
+  // Runtime state, owned by the radio thread once started
+  int bus;
+  uint32_t spi_rtt_ns;            /* one register read, measured at setup */
+  bool sx1272;
+  RegShadow_t shadow;
+  const ModemConf_t* modem_conf;
+  RxStream_t rx_stream;
+  int stream_poll_ms;
+  bool fifo_valid;                /* fifo_next is known */
+  uint8_t fifo_next;              /* where the next frame should start */
+  bool rx_pending;                /* a frame completed during the last read out */
+  uint64_t pending_from_ns;       /* its RxDone lies between these */
+  uint64_t pending_to_ns;
+  int hop_cur;
+  uint64_t hop_next_ns;
+  int irq_fd;
+  int hdr_fd;
+  RxHandler_t rx_handler;
+  pthread_t thread;
+
+  // Guards the statistics read by RadioPrintStats(): hop_channels and
+  // cad_slots counters and the ones below
+  pthread_mutex_t lock;
+  uint32_t shadow_mismatch;
+  uint32_t rx_overrun;            /* frames the FIFO moved past unread */
+  uint32_t rx_caught_up;          /* frames whose RxDone came during a read out */
+  uint32_t rx_streamed;           /* frames partly read out before their RxDone */
+  uint32_t retune_nb;
+  uint32_t retune_max_us;
+} Radio_t;
+
+// Same clock as the kernel GPIO edge event timestamps
+uint64_t MonotonicNs();
+
+// Defaults for radio id, before global_conf.json is applied
+void RadioInit(Radio_t* r, int id);
+// Open the bus, reset and detect the chip and configure it for continuous
+// receive. Returns false, after printing why, if the radio is unusable.
+bool RadioSetup(Radio_t* r);
+// Start the receive thread, every frame goes to handler
+bool RadioStart(Radio_t* r, RxHandler_t handler);
+// Status lines for the periodic report
+void RadioPrintStats(Radio_t* r);
+
+uint8_t ReadRegister(Radio_t* r, uint8_t addr);
+void WriteRegister(Radio_t* r, uint8_t addr, uint8_t value);
+// Move to another channel and/or data rate without resetting the chip.
+// Returns how long the switch took in us, -1 if not supported.
+long Retune(Radio_t* r, uint32_t new_freq, SpreadingFactor_t new_sf, uint16_t new_bw);
+
+#endif // _SX127X_H
@@ -0,0 +1,119 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// LoRa modem register values for every chip / SF / BW / CR combination,
+// generated at compile time together with the matching rxpk "datr" and
+// "codr" strings. Applying a configuration is a table lookup and a burst
+// write of REG_MODEM_CONFIG..REG_SYMB_TIMEOUT_LSB (+ REG_MODEM_CONFIG3).
+
+#ifndef _SX127X_MODEM_H
+#define _SX127X_MODEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MODEM_NB_CHIP  2   // SX1272, SX1276
+#define MODEM_NB_SF    6   // SF7 .. SF12
+#define MODEM_NB_BW    3   // 125, 250, 500 kHz
+#define MODEM_NB_CR    4   // 4/5 .. 4/8
+
+typedef struct ModemConf
+{
+  uint8_t mc1;           /* REG_MODEM_CONFIG */
+  uint8_t mc2;           /* REG_MODEM_CONFIG2 */
+  uint8_t symb_timeout;  /* REG_SYMB_TIMEOUT_LSB */
+  uint8_t mc3;           /* REG_MODEM_CONFIG3, SX1276 only */
+  const char* datr;
+  const char* codr;
+} ModemConf_t;
+
+#define MODEM_DATR_ROW(sf) { "SF" #sf "BW125", "SF" #sf "BW250", "SF" #sf "BW500" }
+
+static constexpr const char* modem_datr[MODEM_NB_SF][MODEM_NB_BW] = {
+  MODEM_DATR_ROW(7), MODEM_DATR_ROW(8), MODEM_DATR_ROW(9),
+  MODEM_DATR_ROW(10), MODEM_DATR_ROW(11), MODEM_DATR_ROW(12)
+};
+
+static constexpr const char* modem_codr[MODEM_NB_CR] = { "4/5", "4/6", "4/7", "4/8" };
+
+static constexpr uint16_t modem_bw_khz[MODEM_NB_BW] = { 125, 250, 500 };
+
+// SX1276 RegModemConfig1 bandwidth field for 125, 250, 500 kHz
+static constexpr uint8_t modem_sx1276_bw[MODEM_NB_BW] = { 0x07, 0x08, 0x09 };
+
+// Low data rate optimize is mandated when a symbol lasts more than 16 ms
+constexpr bool ModemLowDataRate(int sf, int bw_idx)
+{
+  return (1000 << sf) / modem_bw_khz[bw_idx] > 16000;
+}
+
+constexpr ModemConf_t ModemMake(bool sx1272, int sf, int bw_idx, int cr_idx)
+{
+  return ModemConf_t {
+    // SX1272: BW[7:6] CR[5:3] ImplicitHeader[2] CrcOn[1] LowDataRateOptimize[0]
+    // SX1276: BW[7:4] CR[3:1] ImplicitHeader[0]
+    (uint8_t)(sx1272 ? (bw_idx << 6) | ((cr_idx + 1) << 3) | 0x02 | (ModemLowDataRate(sf, bw_idx) ? 0x01 : 0x00)
+                     : (modem_sx1276_bw[bw_idx] << 4) | ((cr_idx + 1) << 1)),
+    // SF[7:4], SX1272: AgcAutoOn[2], SX1276: CrcOn[2]
+    (uint8_t)((sf << 4) | 0x04),
+    (uint8_t)(sf >= 10 ? 0x05 : 0x08),
+    // SX1276: LowDataRateOptimize[3] AgcAutoOn[2]
+    (uint8_t)(sx1272 ? 0x00 : (ModemLowDataRate(sf, bw_idx) ? 0x0C : 0x04)),
+    modem_datr[sf - 7][bw_idx],
+    modem_codr[cr_idx]
+  };
+}
+
+// Flat index: ((chip * NB_SF + sf - 7) * NB_BW + bw_idx) * NB_CR + cr_idx,
+// chip 0 is the SX1272
+constexpr ModemConf_t ModemEntry(int i)
+{
+  return ModemMake(i / (MODEM_NB_SF * MODEM_NB_BW * MODEM_NB_CR) == 0,
+                   7 + i / (MODEM_NB_BW * MODEM_NB_CR) % MODEM_NB_SF,
+                   i / MODEM_NB_CR % MODEM_NB_BW,
+                   i % MODEM_NB_CR);
+}
+
+template<int... I> struct ModemIndexSeq {};
+template<int N, int... I> struct ModemMakeSeq : ModemMakeSeq<N - 1, N - 1, I...> {};
+template<int... I> struct ModemMakeSeq<0, I...> { typedef ModemIndexSeq<I...> type; };
+
+template<typename Seq> struct ModemTable;
+template<int... I> struct ModemTable<ModemIndexSeq<I...> >
+{
+  static constexpr ModemConf_t entries[sizeof...(I)] = { ModemEntry(I)... };
+};
+template<int... I> constexpr ModemConf_t ModemTable<ModemIndexSeq<I...> >::entries[sizeof...(I)];
+
+typedef ModemTable<ModemMakeSeq<MODEM_NB_CHIP * MODEM_NB_SF * MODEM_NB_BW * MODEM_NB_CR>::type> modem_table;
+
+// The values SetupLoRa used to hardcode
+static_assert(ModemEntry(0).mc1 == 0x0A && ModemEntry(0).mc2 == 0x74, "SX1272 SF7BW125 4/5");
+static_assert(ModemEntry(4 * 12).mc1 == 0x0B, "SX1272 SF11BW125 needs LDRO");
+static_assert(ModemEntry(72).mc1 == 0x72 && ModemEntry(72).mc3 == 0x04, "SX1276 SF7BW125 4/5");
+static_assert(ModemEntry(72 + 5 * 12).mc3 == 0x0C, "SX1276 SF12BW125 needs LDRO");
+
+// NULL if the combination is not supported. cr is the 4/cr denominator.
+inline const ModemConf_t* ModemLookup(bool sx1272, int sf, uint16_t bw_khz, int cr)
+{
+  int bw_idx = -1;
+  for (int i = 0; i < MODEM_NB_BW; i++) {
+    if (modem_bw_khz[i] == bw_khz) {
+      bw_idx = i;
+    }
+  }
+  if (sf < 7 || sf > 12 || bw_idx < 0 || cr < 5 || cr > 8) {
+    return NULL;
+  }
+  return &modem_table::entries[(((sx1272 ? 0 : 1) * MODEM_NB_SF + sf - 7) * MODEM_NB_BW + bw_idx) * MODEM_NB_CR + cr - 5];
+}
+
+#endif
@@ -0,0 +1,341 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2015 Thomas Telkamp
+#
+# All rights reserved. This program and the accompanying materials
+# are made available under the terms of the Eclipse Public License v1.0
+# which accompanies this distribution, and is available at
+# http://www.eclipse.org/legal/epl-v10.html
+#
+
+"""End to end checks of single_chan_pkt_fwd on the emulator backend.
+
+Each scenario runs the forwarder with "hal": "emulator" and a script from
+test/emu, waits until the emulator has played it and one more status report
+is out, then compares what went on air with what was forwarded on stdout,
+and the rxpk tmst with the RxDone time the script gave each frame.
+
+    test/emu_check.py              all scenarios, as `make check` does
+    test/emu_check.py cad stream   only those
+"""
+
+import base64
+import json
+import os
+import re
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+FWD = os.path.join(os.path.dirname(TEST_DIR), 'single_chan_pkt_fwd')
+STAT_INTERVAL = 5   # s, as in single_chan_pkt_fwd.cpp
+# tmst from a DIO0 edge is late by the emulator and forwarder thread wake
+# ups, which a busy host can stretch now and then: most frames must be
+# within TMST_EDGE_US, none early
+TMST_EDGE_US = 5000
+
+START = re.compile(r'emulator: script time 0 is tmst (\d+)')
+SUMMARY = re.compile(r'emulator: chip nss=(\d+): (\d+) landed, (\d+) CRC errors, (\d+) missed, (\d+) aborted')
+CAD_STAT = re.compile(r' radio (\d+) SF(\d+): (\d+) CAD, (\d+) preambles, (\d+) caught, (\d+) missed')
+
+
+def config(script, radio, gateway):
+    conf = {
+        'SX127x_conf': {
+            'freq': 868100000,
+            'spread_factor': 7,
+            'bandwidth': 125000,
+            'coding_rate': '4/5',
+            'pin_nss': 11,
+            'pin_dio0': 21,
+            'pin_rst': 25,
+            'hal': 'emulator',
+            'emulator_script': os.path.join(TEST_DIR, 'emu', script),
+        },
+        'gateway_conf': {
+            'ref_latitude': 0.0,
+            'ref_longitude': 0.0,
+            'ref_altitude': 10,
+            'name': 'emulator',
+            'email': 'test@localhost',
+            'desc': 'make check',
+            'if_name': 'lo',
+            'eui': 'CA:D0:3A:32:37:9E',
+            # nothing listens there, sends still succeed
+            'servers': [{'address': '127.0.0.1', 'port': 1700, 'enabled': True}],
+        },
+    }
+    conf['SX127x_conf'].update(radio or {})
+    conf['gateway_conf'].update(gateway or {})
+    return conf
+
+
+def script_lines(script, directive):
+    """Parameters of each script line of that directive, expanded by count / gap."""
+    lines = []
+    with open(os.path.join(TEST_DIR, 'emu', script)) as f:
+        for line in f:
+            tokens = line.split('#')[0].split()
+            if tokens[:1] != [directive]:
+                continue
+            kv = dict(t.split('=', 1) for t in tokens[1:])
+            at = int(kv.get('at', '0'), 0)
+            for i in range(int(kv.get('count', '1'), 0)):
+                lines.append(dict(kv, at=at + i * int(kv.get('gap', '1000'), 0)))
+    return lines
+
+
+def script_frames(script):
+    """RxDone time in ms of each frame, by frame number, None when the
+    script gives its data so that the payload does not carry the number."""
+    return [None if 'data' in f else f['at'] for f in script_lines(script, 'rx')]
+
+
+def script_payloads(script):
+    """Payload each frame went on air with, by frame number, as the
+    emulator builds it: the number, then byte i is i * 0x1D."""
+    payloads = []
+    for f in script_lines(script, 'rx'):
+        if 'data' in f:
+            payloads.append(bytes.fromhex(f['data']))
+        else:
+            seq = len(payloads)
+            payloads.append(bytes((seq >> (8 * (3 - b))) & 0xFF if b < 4 else (b * 0x1D) & 0xFF
+                                  for b in range(int(f.get('len', '1'), 0))))
+    return payloads
+
+
+def frame_number(pkt):
+    """Number of the script frame an rxpk carries, -1 when too short."""
+    data = base64.b64decode(pkt['data'])
+    return int.from_bytes(data[:4], 'big') if len(data) >= 4 else -1
+
+
+class Run(object):
+    """One forwarder run over an emulator script."""
+
+    def __init__(self, script, radio=None, gateway=None, timeout=120):
+        with open(os.path.join(TEST_DIR, 'emu', script)) as f:
+            chip_nb = sum(1 for line in f if line.split()[:1] == ['chip'])
+
+        with tempfile.TemporaryDirectory() as tmp:
+            with open(os.path.join(tmp, 'global_conf.json'), 'w') as f:
+                json.dump(config(script, radio, gateway), f, indent=1)
+            out_path = os.path.join(tmp, 'out.txt')
+            err_path = os.path.join(tmp, 'err.txt')
+            with open(out_path, 'w') as out, open(err_path, 'w') as err:
+                proc = subprocess.Popen([FWD], cwd=tmp, stdout=out, stderr=err)
+
+            # the emulator reports once the script is played
+            deadline = time.time() + timeout
+            while len(SUMMARY.findall(read(err_path))) < chip_nb:
+                if proc.poll() is not None or time.time() > deadline:
+                    proc.kill()
+                    proc.wait()
+                    raise RuntimeError('%s: forwarder stopped early:\n%s%s' % (script, read(out_path), read(err_path)))
+                time.sleep(0.1)
+            time.sleep(STAT_INTERVAL + 0.5)
+            proc.send_signal(signal.SIGINT)
+            proc.wait(10)
+
+            self.out = read(out_path).splitlines()
+            self.err = read(err_path).splitlines()
+
+        self.chips = {}
+        for m in SUMMARY.finditer('\n'.join(self.err)):
+            self.chips[int(m.group(1))] = dict(zip(('landed', 'crc_bad', 'missed', 'aborted'), map(int, m.groups()[1:])))
+
+        # "incoming packet..." is followed by the rxpk line
+        self.rxpk = []
+        self.bad_json = []
+        for i, line in enumerate(self.out[:-1]):
+            if line == 'incoming packet...':
+                try:
+                    self.rxpk.extend(json.loads(self.out[i + 1])['rxpk'])
+                except ValueError:
+                    self.bad_json.append(self.out[i + 1])
+        self.crc_errors = self.out.count('CRC error')
+
+        starts = [i for i, line in enumerate(self.out) if line == 'gateway status update']
+        self.status = self.out[starts[-1]:] if starts else []
+
+        # tmst minus the RxDone time the script gave the frame, in us
+        self.tmst_err = []
+        m = START.search('\n'.join(self.err))
+        frames = script_frames(script)
+        for pkt in self.rxpk if m else []:
+            seq = frame_number(pkt)
+            if 0 <= seq < len(frames) and frames[seq] is not None:
+                err = (pkt['tmst'] - int(m.group(1)) - frames[seq] * 1000) % (1 << 32)
+                self.tmst_err.append(err - (1 << 32) if err >= 1 << 31 else err)
+
+    def tmst_late(self):
+        """Frames with a tmst more than TMST_EDGE_US after their RxDone."""
+        return [e for e in self.tmst_err if e >= TMST_EDGE_US]
+
+    def tmst_spread(self):
+        e = self.tmst_err
+        if not e:
+            return 'no tmst to compare'
+        return 'tmst - RxDone min %d, avg %d, max %d us' % (min(e), sum(e) // len(e), max(e))
+
+    def landed(self):
+        return sum(c['landed'] for c in self.chips.values())
+
+
+def read(path):
+    with open(path) as f:
+        return f.read()
+
+
+def expect(failures, ok, what):
+    if not ok:
+        failures.append(what)
+
+
+def check_rxpk(failures, run):
+    for line in run.bad_json:
+        failures.append('not JSON: %s' % line)
+    for pkt in run.rxpk:
+        expect(failures, len(base64.b64decode(pkt['data'])) == pkt['size'],
+               'rxpk data does not decode to its size: %s' % pkt)
+
+
+def check_payloads(failures, run, script):
+    """Every forwarded frame carries the payload it went on air with."""
+    payloads = script_payloads(script)
+    for pkt in run.rxpk:
+        seq = frame_number(pkt)
+        data = base64.b64decode(pkt['data'])
+        expect(failures, 0 <= seq < len(payloads) and data == payloads[seq],
+               'frame %d: payload %s, sent %s' % (seq, data.hex(), payloads[seq].hex() if 0 <= seq < len(payloads) else '?'))
+
+
+def scenario_stream():
+    """Frames on one channel and data rate, all of them must come out."""
+    run = Run('stream.txt')
+    chip = run.chips[11]
+    failures = []
+    expect(failures, chip['missed'] == 0 and chip['aborted'] == 0, 'frames missed on air: %s' % chip)
+    expect(failures, len(run.rxpk) == chip['landed'], '%d forwarded, %d landed' % (len(run.rxpk), chip['landed']))
+    expect(failures, run.crc_errors == chip['crc_bad'], '%d CRC errors, %d sent' % (run.crc_errors, chip['crc_bad']))
+    # taken from the DIO0 edge: only the wake up of the emulator thread
+    expect(failures, len(run.tmst_err) == len(run.rxpk), 'tmst of %d frames checked, %d forwarded' % (len(run.tmst_err), len(run.rxpk)))
+    expect(failures, min(run.tmst_err + [0]) >= 0 and len(run.tmst_late()) <= len(run.tmst_err) // 10, run.tmst_spread())
+    check_rxpk(failures, run)
+    check_payloads(failures, run, 'stream.txt')
+    return '%d landed, %d forwarded, %d CRC errors, %s' % (chip['landed'], len(run.rxpk), run.crc_errors, run.tmst_spread()), failures
+
+
+def scenario_stream_rx():
+    """The same frames with the FIFO drained during reception: the payload
+    is put together from the drains and the tail read after RxDone."""
+    run = Run('stream.txt', radio={'stream_rx': True, 'pin_dio3': 22})
+    chip = run.chips[11]
+    failures = []
+    expect(failures, any(line.startswith('Radio 0: streaming RX, draining every') for line in run.out), 'streaming RX not on')
+    expect(failures, chip['missed'] == 0 and chip['aborted'] == 0, 'frames missed on air: %s' % chip)
+    expect(failures, len(run.rxpk) == chip['landed'], '%d forwarded, %d landed' % (len(run.rxpk), chip['landed']))
+    expect(failures, run.crc_errors == chip['crc_bad'], '%d CRC errors, %d sent' % (run.crc_errors, chip['crc_bad']))
+    # at least the 200 and 253 byte frames, many drains long
+    long_nb = sum(1 for f in script_lines('stream.txt', 'rx') if int(f.get('len', '0'), 0) >= 200)
+    m = re.search(r'radio 0: (\d+) frames streamed out during reception', '\n'.join(run.status))
+    streamed = int(m.group(1)) if m else 0
+    expect(failures, streamed >= long_nb, '%d frames streamed, %d of 200 bytes or more' % (streamed, long_nb))
+    # RxDone still comes from the DIO0 edge, polled along with the drains
+    expect(failures, min(run.tmst_err + [0]) >= 0 and len(run.tmst_late()) <= len(run.tmst_err) // 10, run.tmst_spread())
+    check_rxpk(failures, run)
+    check_payloads(failures, run, 'stream.txt')
+    return '%d landed, %d forwarded, %d streamed, %s' % (chip['landed'], len(run.rxpk), streamed, run.tmst_spread()), failures
+
+
+def scenario_burst():
+    """Back-to-back frames, three of them with no RxDone edge."""
+    run = Run('burst.txt')
+    chip = run.chips[11]
+    status = '\n'.join(run.status)
+    failures = []
+    expect(failures, chip['missed'] == 0 and chip['aborted'] == 0, 'frames missed on air: %s' % chip)
+    expect(failures, len(run.rxpk) == chip['landed'], '%d forwarded, %d landed' % (len(run.rxpk), chip['landed']))
+    m = re.search(r'radio 0: (\d+) frames lost in the FIFO, (\d+) back to back frames caught up', status)
+    lost, caught_up = (int(m.group(1)), int(m.group(2))) if m else (0, 0)
+    expect(failures, lost == 0 and caught_up == 3, '%d lost in the FIFO, %d caught up, expected 0 and 3' % (lost, caught_up))
+    m = re.search(r'RxDone time estimated for (\d+) caught up frames, within (\d+) us', status)
+    expect(failures, m is not None and int(m.group(1)) == caught_up, 'caught up frames not flagged')
+    # their tmst is off by no more than the bound they were given
+    bound = int(m.group(2)) if m else 0
+    early = [e for e in run.tmst_err if e < 0]
+    expect(failures, len(early) <= caught_up and all(-e <= bound for e in early),
+           'tmst early by %s us, caught up frames within %d us' % (early, bound))
+    late = [e for e in run.tmst_late() if e > bound]
+    expect(failures, len(late) <= len(run.tmst_err) // 10, 'tmst late by %s us' % late)
+    # caught up frames have no edge: they must stay out of the latency
+    # histogram, where only the three stalled read outs take 5 ms or more
+    m = re.search(r'RxDone to FIFO drained since start, us.* more: (\d+)', status)
+    expect(failures, m is not None and int(m.group(1)) == 3, 'latency histogram: %s' % (m.group(0) if m else 'missing'))
+    check_rxpk(failures, run)
+    return '%d landed, %d forwarded, %d caught up, %s' % (chip['landed'], len(run.rxpk), caught_up, run.tmst_spread()), failures
+
+
+def scenario_cad():
+    """CAD over SF7..SF12: a preamble the CAD saw must be received."""
+    run = Run('cad.txt', radio={'cad_sf': [7, 8, 9, 10, 11, 12]})
+    failures = []
+    detected = 0
+    for m in CAD_STAT.finditer('\n'.join(run.status)):
+        sf, preambles, caught, missed = int(m.group(2)), int(m.group(4)), int(m.group(5)), int(m.group(6))
+        detected += preambles
+        expect(failures, missed == 0, 'SF%d: %d preambles, %d caught, %d missed' % (sf, preambles, caught, missed))
+    expect(failures, detected > 0, 'no preamble detected')
+    expect(failures, len(run.rxpk) == run.landed(), '%d forwarded, %d landed' % (len(run.rxpk), run.landed()))
+    check_rxpk(failures, run)
+    return '%d preambles detected, %d of 8 frames forwarded' % (detected, len(run.rxpk)), failures
+
+
+def scenario_hop():
+    """Traffic moving between channels: hopping must catch more of it than a
+    radio left on any one channel would, and report the channel it was on."""
+    channels = [868100000, 868300000, 868500000]
+    run = Run('hop.txt', radio={'channels': channels, 'dwell_ms': 2000})
+    frames = script_lines('hop.txt', 'rx')
+    failures = []
+    best_static = max(sum(1 for f in frames if int(f.get('freq', '0')) == freq) for freq in channels)
+    expect(failures, len(run.rxpk) > best_static, '%d forwarded, a static channel catches %d' % (len(run.rxpk), best_static))
+    for pkt in run.rxpk:
+        freq = int(frames[frame_number(pkt)]['freq'])
+        expect(failures, round(pkt['freq'] * 1e6) == freq and pkt['chan'] == channels.index(freq),
+               'frame on %d reported on %s MHz chan %d' % (freq, pkt['freq'], pkt['chan']))
+    check_rxpk(failures, run)
+    return '%d of %d frames forwarded, a static channel catches %d' % (len(run.rxpk), len(frames), best_static), failures
+
+
+SCENARIOS = [
+    ('stream', scenario_stream),
+    ('stream_rx', scenario_stream_rx),
+    ('burst', scenario_burst),
+    ('cad', scenario_cad),
+    ('hop', scenario_hop),
+]
+
+
+def main(names):
+    if not os.path.exists(FWD):
+        sys.exit('%s not built' % FWD)
+    failed = 0
+    for name, scenario in SCENARIOS:
+        if names and name not in names:
+            continue
+        summary, failures = scenario()
+        print('%-9s %s: %s' % (name, summary, 'ok' if not failures else 'FAILED'))
+        for failure in failures:
+            print('          %s' % failure)
+        failed += len(failures) > 0
+        sys.stdout.flush()
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -0,0 +1,233 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// Plain C stand-in for the NEON intrinsics base64.c uses, lane by lane, so
+// that its NEON code builds and runs on any host:
+//
+//   g++ -D__ARM_NEON -Itest/neon ... base64.c
+//
+// It follows the ARM definitions of the intrinsics, not their speed. Only
+// what base64.c needs is here; the real header is still the one to compile
+// against, see `make base64-cross`.
+
+#ifndef _TEST_ARM_NEON_H
+#define _TEST_ARM_NEON_H
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct { uint8_t v[8]; } uint8x8_t;
+typedef struct { uint8_t v[16]; } uint8x16_t;
+typedef struct { uint64_t v[1]; } uint64x1_t;
+typedef struct { uint8x8_t val[2]; } uint8x8x2_t;
+typedef struct { uint8x16_t val[3]; } uint8x16x3_t;
+typedef struct { uint8x16_t val[4]; } uint8x16x4_t;
+
+#define NEON_LANES(r, n, expr) \
+  do { int i; for (i = 0; i < (n); i++) { (r).v[i] = (uint8_t)(expr); } } while (0)
+
+static inline uint8x16_t vdupq_n_u8(uint8_t x)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, x);
+  return r;
+}
+
+static inline uint8x16_t vld1q_u8(const uint8_t* p)
+{
+  uint8x16_t r;
+  memcpy(r.v, p, 16);
+  return r;
+}
+
+static inline uint8x8_t vld1_u8(const uint8_t* p)
+{
+  uint8x8_t r;
+  memcpy(r.v, p, 8);
+  return r;
+}
+
+static inline uint8x16_t vaddq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] + b.v[i]);
+  return r;
+}
+
+static inline uint8x16_t vsubq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] - b.v[i]);
+  return r;
+}
+
+// saturating subtract
+static inline uint8x16_t vqsubq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] > b.v[i] ? a.v[i] - b.v[i] : 0);
+  return r;
+}
+
+static inline uint8x16_t vandq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] & b.v[i]);
+  return r;
+}
+
+static inline uint8x16_t vorrq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] | b.v[i]);
+  return r;
+}
+
+static inline uint8x8_t vorr_u8(uint8x8_t a, uint8x8_t b)
+{
+  uint8x8_t r;
+  NEON_LANES(r, 8, a.v[i] | b.v[i]);
+  return r;
+}
+
+static inline uint8x16_t vmvnq_u8(uint8x16_t a)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, ~a.v[i]);
+  return r;
+}
+
+// comparisons give all ones or all zeros per lane
+static inline uint8x16_t vcltq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] < b.v[i] ? 0xFF : 0);
+  return r;
+}
+
+static inline uint8x16_t vceqq_u8(uint8x16_t a, uint8x16_t b)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] == b.v[i] ? 0xFF : 0);
+  return r;
+}
+
+static inline uint8x16_t vshrq_n_u8(uint8x16_t a, int n)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] >> n);
+  return r;
+}
+
+static inline uint8x16_t vshlq_n_u8(uint8x16_t a, int n)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, a.v[i] << n);
+  return r;
+}
+
+static inline uint8x8_t vget_low_u8(uint8x16_t a)
+{
+  uint8x8_t r;
+  memcpy(r.v, a.v, 8);
+  return r;
+}
+
+static inline uint8x8_t vget_high_u8(uint8x16_t a)
+{
+  uint8x8_t r;
+  memcpy(r.v, a.v + 8, 8);
+  return r;
+}
+
+static inline uint8x16_t vcombine_u8(uint8x8_t lo, uint8x8_t hi)
+{
+  uint8x16_t r;
+  memcpy(r.v, lo.v, 8);
+  memcpy(r.v + 8, hi.v, 8);
+  return r;
+}
+
+// table lookups, an index past the table gives 0
+static inline uint8x8_t vtbl2_u8(uint8x8x2_t t, uint8x8_t idx)
+{
+  uint8x8_t r;
+  NEON_LANES(r, 8, idx.v[i] < 16 ? t.val[idx.v[i] / 8].v[idx.v[i] % 8] : 0);
+  return r;
+}
+
+static inline uint8x16_t vqtbl1q_u8(uint8x16_t t, uint8x16_t idx)
+{
+  uint8x16_t r;
+  NEON_LANES(r, 16, idx.v[i] < 16 ? t.v[idx.v[i]] : 0);
+  return r;
+}
+
+static inline uint64x1_t vreinterpret_u64_u8(uint8x8_t a)
+{
+  uint64x1_t r;
+  memcpy(r.v, a.v, 8);
+  return r;
+}
+
+static inline uint64_t vget_lane_u64(uint64x1_t a, int lane)
+{
+  return a.v[lane];
+}
+
+// structure loads and stores, interleaved in memory
+static inline uint8x16x3_t vld3q_u8(const uint8_t* p)
+{
+  uint8x16x3_t r;
+  int i, k;
+  for (i = 0; i < 16; i++) {
+    for (k = 0; k < 3; k++) {
+      r.val[k].v[i] = p[3 * i + k];
+    }
+  }
+  return r;
+}
+
+static inline uint8x16x4_t vld4q_u8(const uint8_t* p)
+{
+  uint8x16x4_t r;
+  int i, k;
+  for (i = 0; i < 16; i++) {
+    for (k = 0; k < 4; k++) {
+      r.val[k].v[i] = p[4 * i + k];
+    }
+  }
+  return r;
+}
+
+static inline void vst3q_u8(uint8_t* p, uint8x16x3_t a)
+{
+  int i, k;
+  for (i = 0; i < 16; i++) {
+    for (k = 0; k < 3; k++) {
+      p[3 * i + k] = a.val[k].v[i];
+    }
+  }
+}
+
+static inline void vst4q_u8(uint8_t* p, uint8x16x4_t a)
+{
+  int i, k;
+  for (i = 0; i < 16; i++) {
+    for (k = 0; k < 4; k++) {
+      p[4 * i + k] = a.val[k].v[i];
+    }
+  }
+}
+
+#undef NEON_LANES
+
+#endif // _TEST_ARM_NEON_H
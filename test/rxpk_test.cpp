@@ -0,0 +1,320 @@
+/*******************************************************************************
+ *
+ * Copyright (c) 2015 Thomas Telkamp
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ *******************************************************************************/
+
+// rxpk.cpp against the rapidjson code ForwardPacket() used before it, on
+// random frames: every data rate and coding rate, both chips, frequencies
+// on and off the channel table, every payload length.
+//
+//   test/rxpk_test          same datagram text, exits 1 on a mismatch
+//   test/rxpk_test bench    ns per datagram, old code against new
+
+#include "base64.h"
+#include "rxpk.h"
+
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+using namespace std;
+using namespace rapidjson;
+
+#define PROTOCOL_VERSION  1
+#define PKT_PUSH_DATA 0
+#define TX_BUFF_SIZE  2048
+#define BASE64_MAX_LENGTH 342    /* 341 before, 253 and 254 byte frames went out unpadded */
+
+static const uint8_t hwaddr[6] = { 0xb8, 0x27, 0xeb, 0x12, 0x34, 0x56 };
+
+static int failures = 0;
+
+/* -------------------------------------------------------------------------- */
+/* --- ForwardPacket() as it was, without the stats and the send ------------ */
+
+static int OldDatagram(const RxPacket_t* p_pkt, char* buff_up)
+{
+  long int SNR;
+  int rssicorr;
+
+  uint8_t value = p_pkt->meta.snr;
+  if (value & 0x80) { // The SNR sign bit is 1
+    // Invert and divide by 4
+    value = ((~value + 1) & 0xFF) >> 2;
+    SNR = -value;
+  } else {
+    // Divide by 4
+    SNR = ( value & 0xFF ) >> 2;
+  }
+
+  rssicorr = p_pkt->sx1272 ? 139 : 157;
+
+  int buff_index = 0;
+
+  /* pre-fill the data buffer with fixed fields */
+  buff_up[0] = PROTOCOL_VERSION;
+  buff_up[3] = PKT_PUSH_DATA;
+
+  buff_up[4] = (uint8_t)hwaddr[0];
+  buff_up[5] = (uint8_t)hwaddr[1];
+  buff_up[6] = (uint8_t)hwaddr[2];
+  buff_up[7] = 0xFF;
+  buff_up[8] = 0xFF;
+  buff_up[9] = (uint8_t)hwaddr[3];
+  buff_up[10] = (uint8_t)hwaddr[4];
+  buff_up[11] = (uint8_t)hwaddr[5];
+
+  /* start composing datagram with the header */
+  uint8_t token_h = (uint8_t)rand(); /* random token */
+  uint8_t token_l = (uint8_t)rand(); /* random token */
+  buff_up[1] = token_h;
+  buff_up[2] = token_l;
+  buff_index = 12; /* 12-byte header */
+
+  uint32_t tmst = (uint32_t)(p_pkt->irq_ns / 1000);
+
+  // Encode payload.
+  char b64[BASE64_MAX_LENGTH];
+  bin_to_b64(p_pkt->payload, p_pkt->length, b64, BASE64_MAX_LENGTH);
+
+  // Build JSON object.
+  StringBuffer sb;
+  Writer<StringBuffer> writer(sb);
+  writer.StartObject();
+  writer.String("rxpk");
+  writer.StartArray();
+  writer.StartObject();
+  writer.String("tmst");
+  writer.Uint(tmst);
+  writer.String("freq");
+  writer.Double((double)p_pkt->freq / 1000000);
+  writer.String("chan");
+  writer.Uint(p_pkt->chan);
+  writer.String("rfch");
+  writer.Uint(p_pkt->rfch);
+  writer.String("stat");
+  writer.Uint(1);
+  writer.String("modu");
+  writer.String("LORA");
+  writer.String("datr");
+  writer.String(p_pkt->modem_conf->datr);
+  writer.String("codr");
+  writer.String(p_pkt->modem_conf->codr);
+  writer.String("rssi");
+  writer.Int(p_pkt->meta.pkt_rssi - rssicorr);
+  writer.String("lsnr");
+  writer.Double(SNR); // %li.
+  writer.String("size");
+  writer.Uint(p_pkt->length);
+  writer.String("data");
+  writer.String(b64);
+  writer.EndObject();
+  writer.EndArray();
+  writer.EndObject();
+
+  string json = sb.GetString();
+
+  memcpy(buff_up + 12, json.c_str(), json.size());
+  return buff_index + json.size();
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- ForwardPacket() now ------------------------------------------------- */
+
+static uint8_t rxpk_head[12];
+
+static void NewInit()
+{
+  rxpk_head[0] = PROTOCOL_VERSION;
+  rxpk_head[3] = PKT_PUSH_DATA;
+  rxpk_head[4] = hwaddr[0];
+  rxpk_head[5] = hwaddr[1];
+  rxpk_head[6] = hwaddr[2];
+  rxpk_head[7] = 0xFF;
+  rxpk_head[8] = 0xFF;
+  rxpk_head[9] = hwaddr[3];
+  rxpk_head[10] = hwaddr[4];
+  rxpk_head[11] = hwaddr[5];
+}
+
+static int NewDatagram(const RxPacket_t* p_pkt, const RxpkChan_t* c, char* buff_up)
+{
+  memcpy(buff_up, rxpk_head, sizeof(rxpk_head));
+  char* p = RxpkPutStr(buff_up + sizeof(rxpk_head), "{\"rxpk\":[");
+  p = RxpkPut(p, p_pkt, c);
+  if (p == NULL) {
+    return -1;
+  }
+  p = RxpkPutStr(p, "]}");
+  buff_up[1] = (uint8_t)rand();
+  buff_up[2] = (uint8_t)rand();
+  return p - buff_up;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- Frames --------------------------------------------------------------- */
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t Random()
+{
+  // xorshift32, the same sequence on every run
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static const uint16_t bws[] = { 125, 250, 500 };
+
+// A frame and the channel it came in on; off the table one time in four
+static void RandomFrame(RxPacket_t* pkt, RxpkChan_t* c, int length)
+{
+  memset(pkt, 0, sizeof(*pkt));
+  pkt->rfch = Random() % RADIO_MAX;
+  pkt->chan = Random() % (RADIO_MAX * HOP_MAX_CHANNELS);
+  pkt->crc_ok = true;
+  pkt->sx1272 = Random() & 1;
+  pkt->freq = (Random() & 1) ? 863000000 + Random() % 7000000 : 868100000 + 200000 * (Random() % 8);
+  pkt->modem_conf = ModemLookup(pkt->sx1272, 7 + Random() % 6, bws[Random() % 3], 5 + Random() % 4);
+  pkt->irq_ns = ((uint64_t)Random() << 32) | Random();
+  pkt->meta.snr = Random();
+  pkt->meta.pkt_rssi = Random();
+  pkt->length = length;
+  for (int i = 0; i < length; i++) {
+    pkt->payload[i] = Random();
+  }
+  RxpkChanInit(c, Random() % 4 ? pkt->freq : pkt->freq + 100000, pkt->chan, pkt->rfch);
+}
+
+// Datagrams the same but for the token, and for "freq" where rapidjson's
+// Double() can add a last digit: 867.8460690000001 for 867.846069 MHz
+static bool SameDatagram(const char* a, int a_len, const char* b, int b_len)
+{
+  if (a[0] != b[0] || memcmp(a + 3, b + 3, 9) != 0) {
+    return false;
+  }
+  string sa(a + 12, a_len - 12);
+  string sb(b + 12, b_len - 12);
+  size_t fa = sa.find("\"freq\":");
+  size_t fb = sb.find("\"freq\":");
+  if (fa == string::npos || fb == string::npos) {
+    return sa == sb;
+  }
+  size_t ea = sa.find(',', fa);
+  size_t eb = sb.find(',', fb);
+  double mhz_a = atof(sa.c_str() + fa + 7);
+  double mhz_b = atof(sb.c_str() + fb + 7);
+  return llround(mhz_a * 1e6) == llround(mhz_b * 1e6) && sa.substr(0, fa) == sb.substr(0, fb) && sa.substr(ea) == sb.substr(eb);
+}
+
+static void Test()
+{
+  RxPacket_t pkt;
+  RxpkChan_t c;
+  char old_buf[TX_BUFF_SIZE];
+  char new_buf[TX_BUFF_SIZE];
+
+  for (int n = 0; n < 20000; n++) {
+    RandomFrame(&pkt, &c, n % 256);
+    int old_len = OldDatagram(&pkt, old_buf);
+    int new_len = NewDatagram(&pkt, &c, new_buf);
+    if (new_len < 0) {
+      if (++failures <= 10) {
+        printf("FAILED: frame %d, payload not encoded\n", n);
+      }
+      continue;
+    }
+    if (!SameDatagram(old_buf, old_len, new_buf, new_len)) {
+      if (++failures <= 10) {
+        printf("FAILED: frame %d\n old %.*s\n new %.*s\n", n, old_len - 12, old_buf + 12, new_len - 12, new_buf + 12);
+      }
+    }
+    // the longest object is RXPK_MAX_FIXED plus its base64 data
+    int obj_len = new_len - sizeof(rxpk_head) - strlen("{\"rxpk\":[]}");
+    if (obj_len > RXPK_MAX_FIXED + 4 * ((pkt.length + 2) / 3)) {
+      if (++failures <= 10) {
+        printf("FAILED: frame %d: %d bytes is more than RXPK_MAX_FIXED allows\n", n, obj_len);
+      }
+    }
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- Benchmark ------------------------------------------------------------ */
+
+static uint64_t NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static volatile int sink;
+
+// ns per datagram, best of 5 runs of 20000
+static double Time(bool old, const RxPacket_t* pkt, const RxpkChan_t* c)
+{
+  char buf[TX_BUFF_SIZE];
+  double best = 1e9;
+
+  for (int run = 0; run < 5; run++) {
+    uint64_t t0 = NowNs();
+    for (int n = 0; n < 20000; n++) {
+      sink = old ? OldDatagram(pkt, buf) : NewDatagram(pkt, c, buf);
+    }
+    double ns = (double)(NowNs() - t0) / 20000;
+    if (ns < best) {
+      best = ns;
+    }
+  }
+  return best;
+}
+
+static void Bench()
+{
+  // a short LoRaWAN uplink, a typical one, and the largest the radio takes
+  static const int sizes[] = { 23, 51, 255 };
+  RxPacket_t pkt;
+  RxpkChan_t c;
+
+  printf("%-12s %5s %10s %10s\n", "", "bytes", "old ns", "new ns");
+  for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    RandomFrame(&pkt, &c, sizes[i]);
+    RxpkChanInit(&c, pkt.freq, pkt.chan, pkt.rfch);
+    double old_ns = Time(true, &pkt, &c);
+    double new_ns = Time(false, &pkt, &c);
+    printf("%-12s %5d %10.1f %10.1f\n", "rxpk", sizes[i], old_ns, new_ns);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  NewInit();
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    Bench();
+    return 0;
+  }
+
+  Test();
+
+  if (failures > 0) {
+    printf("rxpk: %d checks failed\n", failures);
+    return 1;
+  }
+  printf("rxpk: ok\n");
+  return 0;
+}